@@ -37,11 +37,15 @@ main (int argc, char *argv[])
       return EXIT_FAILURE;
     }
 
-  /* Copy data. */
+  /* Copy data.  The buffer is large enough for the kernel to move
+     it without going through the buffer cache.  A read past the end
+     of the file returns nothing, so ask for at most what is left. */
+  int left = filesize (in_fd);
   for (;;) 
     {
-      char buffer[1024];
-      int bytes_read = read (in_fd, buffer, sizeof buffer);
+      static char buffer[32768];
+      int bytes_read = read (in_fd, buffer,
+                             left < (int) sizeof buffer ? left : (int) sizeof buffer);
       if (bytes_read == 0)
         break;
       if (write (out_fd, buffer, bytes_read) != bytes_read) 
@@ -49,6 +53,7 @@ main (int argc, char *argv[])
           printf ("%s: write failed\n", argv[2]);
           return EXIT_FAILURE;
         }
+      left -= bytes_read;
     }
 
   return EXIT_SUCCESS;
@@ -1,26 +1,281 @@
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 #include "filesys/cache.h"
 #include "threads/thread.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
 #include "filesys/filesys.h"
-#include "devices/timer.h"
+#include <round.h>
 
-// List of all the blocks that are in the process of getting evicted
-struct list evict_list ;
+// BUFFER CACHE Blocks, the lock of the lists used by the eviction algorithm and the clock list
+struct cache_shard cache_shards[CACHE_SHARDS] ;
+struct lock cache ;
+struct list cache_list ;
 
-struct lock evict ;
+// Number of cache blocks present in CACHE_LIST. Protected by the CACHE lock
+static int cache_cnt ;
+
+// Most blocks ever holding a sector at once. Protected by the CACHE lock
+static int cache_peak ;
+
+// Replacement policy
+enum cache_policy cache_policy = CACHE_2Q ;
+
+// FIFO of the blocks brought in by CACHE_2Q which have not proven to be hot yet, oldest first, and its length
+// Protected by the CACHE lock
+static struct list cache_in ;
+static int cache_in_cnt ;
+
+// Sector recently evicted from the FIFO of new blocks. A miss on it means it is hot, so it goes straight to the clock
+struct cache_ghost
+{
+	block_sector_t idx ;						// HASH KEY. Sector number
+	struct hash_elem hash_elem ;				// Element in GHOSTS
+	struct list_elem elem ;						// Element in GHOST_LIST or GHOST_FREE
+} ;
+
+// Ghosts of CACHE_2Q: hashed by sector, and in the order they were evicted. Protected by the CACHE lock
+// The pool holds enough entries for the largest cache the ghost list may be sized for
+static struct cache_ghost *ghost_pool ;
+static struct hash ghosts ;
+static struct list ghost_list ;
+static struct list ghost_free ;
+static int ghost_cnt ;
+
+// Pool of cache block descriptors and their page-aligned sector buffers, allocated once by cache_init()
+static struct cache *cache_pool ;
+static uint8_t *cache_data ;
+
+// Page borrowed from the user pool while it has free frames, with the descriptors of its blocks
+struct cache_page
+{
+	void *kpage ;									// Page holding the block buffers
+	struct cache blocks[CACHE_PAGE_SECTORS] ;		// Cache blocks in KPAGE. Only PAGE_BLOCKS of them are used
+	struct list_elem elem ;							// List element in CACHE_PAGES
+} ;
+
+// Pages borrowed from the user pool, most recent last. Protected by the CACHE lock
+static struct list cache_pages ;
+
+// Number of cache blocks in the pool and in the borrowed pages. Protected by the CACHE lock
+static int cache_capacity ;
+
+// List of the cache blocks of the pool which hold no sector. Protected by the CACHE lock
+static struct list cache_free ;
+
+// Signalled with the CACHE lock held when a block is freed, or unpinned while threads wait in cache_allocate()
+// CACHE_ALLOC_WAITERS counts those threads and CACHE_UNPIN_GEN counts the signals. Protected by the CACHE lock
+static struct condition cache_unpinned ;
+static int cache_alloc_waiters ;
+static unsigned cache_unpin_gen ;
+
+// Cache size tunables
+int cache_size = CACHE_DEFAULT_SIZE ;
+int cache_max_size = CACHE_DEFAULT_MAX ;
+
+// Number of sectors held by each cache block
+int cache_line_sectors = 1 ;
+
+// Number of cache blocks in one page of buffers, and the most blocks the cache may grow to
+static int page_blocks ;
+static int cache_max_blocks ;
+
+// Blocks collected by a write-back pass and the dirty sectors taken from each. Hold CACHE_MAX_BLOCKS entries
+// Protected by FLUSH_LOCK
+static struct cache **flush_batch ;
+static uint32_t *flush_dirty ;
+
+// Buffer in which runs of consecutive dirty sectors are gathered for a single write. Holds CACHE_WRITE_RUN sectors
+// Protected by FLUSH_LOCK
+static uint8_t *write_buf ;
+
+// Write-behind tunables
+int cache_dirty_age = CACHE_DIRTY_AGE ;
+int cache_dirty_ratio = CACHE_DIRTY_RATIO ;
+
+// Number of dirty cache blocks
+// Protected by DIRTY_LOCK. No other lock is ever acquired while holding DIRTY_LOCK
+static int dirty_cnt ;
+static struct lock dirty_lock ;
+
+// Serializes the write-back passes. Writers throttled by the dirty ratio queue up on it
+static struct lock flush_lock ;
+
+// Set by release_cache() to stop the flusher thread. Protected by FLUSH_LOCK
+static bool cache_closed ;
+
+// Ring of sectors waiting to be read ahead, protected by READAHEAD_LOCK
+static block_sector_t readahead_queue[READAHEAD_QUEUE] ;
+static int readahead_head ;
+static int readahead_cnt ;
+static struct lock readahead_lock ;
+
+// Signalled when a request is queued, when the read-ahead thread goes idle and when the cache is closed
+static struct condition readahead_cond ;
+
+// True while the read-ahead thread is reading a sector, and when the cache is closed
+static bool readahead_busy ;
+static bool readahead_closed ;
+
+static unsigned ghost_hash ( const struct hash_elem *e, void *aux UNUSED ) ;
+static bool ghost_less ( const struct hash_elem *a, const struct hash_elem *b, void *aux UNUSED ) ;
+static void cache_flusher ( void *aux UNUSED ) ;
+static bool cache_evict_block ( struct cache *c ) ;
+static int cache_sector_cmp ( const void *a_, const void *b_ ) ;
+static void cache_write_batch ( int n ) ;
+static void cache_reader ( void *aux UNUSED ) ;
+
+// Returns the shard in which the block starting at sector IDX lives
+static struct cache_shard * cache_shard ( block_sector_t idx )
+{
+	return &cache_shards[idx / cache_line_sectors % CACHE_SHARDS] ;
+}
+
+// Returns the first sector of the block holding SECTOR
+static block_sector_t cache_line_start ( block_sector_t sector )
+{
+	return sector - sector % cache_line_sectors ;
+}
+
+// Returns the bit standing for SECTOR in the sector masks of the block C
+static uint32_t cache_sector_bit ( const struct cache *c, block_sector_t sector )
+{
+	return (uint32_t) 1 << ( sector - c->idx ) ;
+}
+
+// Returns the data of SECTOR in the block C
+static uint8_t * cache_sector_data ( const struct cache *c, block_sector_t sector )
+{
+	return (uint8_t *) c->kblock + ( sector - c->idx ) * BLOCK_SECTOR_SIZE ;
+}
+
+// Returns the mask of the sectors of the block C which exist on the disk. The last block may run past its end
+static uint32_t cache_line_mask ( const struct cache *c )
+{
+	block_sector_t left = block_size(fs_device) - c->idx ;
+	int cnt = left < (block_sector_t) cache_line_sectors ? (int) left : cache_line_sectors ;
+
+	return ( (uint32_t) 1 << cnt ) - 1 ;
+}
+
+// Read or write the sectors of the block C in the mask SECTORS, with one device request per run of consecutive sectors
+static void cache_transfer ( struct cache *c, uint32_t sectors, bool write )
+{
+	int first = 0 ;
+
+	while ( sectors >> first != 0 )
+	{
+		if ( ( sectors & ( (uint32_t) 1 << first ) ) == 0 )
+		{
+			first ++ ;
+			continue ;
+		}
+
+		int cnt = 1 ;
+		while ( sectors & ( (uint32_t) 1 << ( first + cnt ) ) )
+			cnt ++ ;
+
+		uint8_t *data = (uint8_t *) c->kblock + first * BLOCK_SECTOR_SIZE ;
+		if ( write == true )
+			block_write_multiple(fs_device, c->idx + first, cnt, data) ;
+		else
+			block_read_multiple(fs_device, c->idx + first, cnt, data) ;
+
+		first += cnt ;
+	}
+}
 
 // Initialize the cache block table, list of cache blocks and the lock to synchronize the access to the list of cache blocks
 void cache_init ()
 {
-	hash_init(&cache_blocks, cache_hash, cache_less, NULL);
+	int i ;
+
+	for ( i = 0 ; i < CACHE_SHARDS ; i ++ )
+	{
+		hash_init(&cache_shards[i].blocks, cache_hash, cache_less, NULL);
+		lock_init(&cache_shards[i].lock) ;
+		memset ( &cache_shards[i].stats, 0, sizeof cache_shards[i].stats ) ;
+	}
 
 	lock_init(&cache) ;
 	list_init(&cache_list);
+	list_init(&cache_free);
+	cond_init(&cache_unpinned) ;
+	cache_alloc_waiters = 0 ;
+	cache_unpin_gen = 0 ;
+	list_init(&cache_pages);
+	list_init(&cache_in);
+	cache_cnt = cache_in_cnt = cache_peak = 0 ;
+
+	// A block holds either one sector or a whole page of them
+	if ( cache_line_sectors != CACHE_PAGE_SECTORS )
+		cache_line_sectors = 1 ;
+	page_blocks = CACHE_PAGE_SECTORS / cache_line_sectors ;
+
+	// The pool allocated at boot is made of whole pages and is never given back
+	if ( cache_size < CACHE_PAGE_SECTORS )
+		cache_size = CACHE_PAGE_SECTORS ;
+	cache_size = ROUND_UP ( cache_size, CACHE_PAGE_SECTORS ) ;
+	if ( cache_max_size < cache_size )
+		cache_max_size = cache_size ;
+	cache_max_size = ROUND_DOWN ( cache_max_size, CACHE_PAGE_SECTORS ) ;
+	cache_capacity = cache_size / cache_line_sectors ;
+	cache_max_blocks = cache_max_size / cache_line_sectors ;
+
+	// Allocate the pool up front. Misses recycle blocks of the pool in place
+	size_t data_pages = cache_size / CACHE_PAGE_SECTORS ;
+
+	cache_pool = calloc ( cache_capacity, sizeof *cache_pool ) ;
+	cache_data = palloc_get_multiple ( PAL_ZERO, data_pages ) ;
+	flush_batch = malloc ( cache_max_blocks * sizeof *flush_batch ) ;
+	flush_dirty = malloc ( cache_max_blocks * sizeof *flush_dirty ) ;
+	write_buf = malloc ( CACHE_WRITE_RUN * BLOCK_SECTOR_SIZE ) ;
+	ghost_pool = calloc ( cache_max_blocks / 2, sizeof *ghost_pool ) ;
+	if ( cache_pool == NULL || cache_data == NULL || flush_batch == NULL || flush_dirty == NULL || write_buf == NULL
+			|| ghost_pool == NULL || !hash_init(&ghosts, ghost_hash, ghost_less, NULL) )
+		PANIC("cache_init: Failed to allocate memory to the buffer cache");
+
+	list_init(&ghost_list) ;
+	list_init(&ghost_free) ;
+	ghost_cnt = 0 ;
+	for ( i = 0 ; i < cache_max_blocks / 2 ; i ++ )
+		list_push_back(&ghost_free, &ghost_pool[i].elem) ;
+
+	for ( i = 0 ; i < cache_capacity ; i ++ )
+	{
+		struct cache *c = &cache_pool[i] ;
 
-	lock_init(&evict) ;
-	list_init(&evict_list);
+		c->kblock = cache_data + i * cache_line_sectors * BLOCK_SECTOR_SIZE ;
+		c->state = CACHE_FREE ;
+		cond_init(&c->io_done) ;
+		list_push_back(&cache_free, &c->elem) ;
+	}
+
+	printf ("Buffer cache: %d sectors in blocks of %d, %zu kB of descriptors and buffers, may grow to %d sectors, "
+			"%s policy.\n", cache_size, cache_line_sectors,
+			( cache_capacity * sizeof *cache_pool + data_pages * PGSIZE ) / 1024, cache_max_size,
+			cache_policy == CACHE_2Q ? "2Q" : "clock" ) ;
+
+	lock_init(&dirty_lock) ;
+	lock_init(&flush_lock) ;
+	dirty_cnt = 0 ;
+	cache_closed = false ;
+
+	lock_init(&readahead_lock) ;
+	cond_init(&readahead_cond) ;
+	readahead_head = readahead_cnt = 0 ;
+	readahead_busy = readahead_closed = false ;
+
+	// Start the write-behind and the read-ahead threads
+	tid_t tid = thread_create("cache_flusher", PRI_DEFAULT, cache_flusher, NULL) ;
+	if ( tid == TID_ERROR )
+		PANIC("cache_init: Couldn't create the flusher thread");
+
+	tid = thread_create("cache_reader", PRI_DEFAULT, cache_reader, NULL) ;
+	if ( tid == TID_ERROR )
+		PANIC("cache_init: Couldn't create the read-ahead thread");
 
 	return ;
 }
@@ -48,7 +303,7 @@ struct cache * cache_lookup (block_sector_t idx)
 	struct hash_elem *e;
 
 	c.idx = idx;
-	e = hash_find (&cache_blocks, &c.hash_elem);
+	e = hash_find (&cache_shard(idx)->blocks, &c.hash_elem);
 
 	return e != NULL ? hash_entry (e, struct cache, hash_elem) : NULL;
 }
@@ -57,133 +312,501 @@ struct cache * cache_lookup (block_sector_t idx)
 struct hash_elem * cache_insert ( struct hash_elem *new )
 {
 	struct hash_elem *e ;
+	struct cache *c = hash_entry (new, struct cache, hash_elem);
 
-	e = hash_insert (&cache_blocks, new);
+	e = hash_insert (&cache_shard(c->idx)->blocks, new);
 
-	return e ;	
+	return e ;
 }
 
-// Search if the block IDX is present in the evict_list
-// This means that the block is about to be evicted. The caller will wait till the block is evicted
-static bool search_block_in_evicted ( block_sector_t idx )
+// Returns a hash value for the ghost E
+static unsigned ghost_hash ( const struct hash_elem *e, void *aux UNUSED )
 {
-	struct list_elem *e ;
-	bool result = false ;
+	const struct cache_ghost *g = hash_entry (e, struct cache_ghost, hash_elem);
+	return hash_bytes (&g->idx, sizeof g->idx);
+}
+
+// Returns true if the ghost A precedes the ghost B
+static bool ghost_less ( const struct hash_elem *a, const struct hash_elem *b, void *aux UNUSED )
+{
+	return hash_entry (a, struct cache_ghost, hash_elem)->idx < hash_entry (b, struct cache_ghost, hash_elem)->idx ;
+}
 
-	for ( e = list_begin(&evict_list) ; e != list_end(&evict_list) ; e = list_next(e) )
+// Remember that the sector IDX was evicted from the FIFO of new blocks, forgetting the oldest ghost if there are
+// as many as half the cache. Must be called with the CACHE lock held
+static void ghost_add ( block_sector_t idx )
+{
+	struct cache_ghost *g ;
+
+	if ( ghost_cnt > 0 && ghost_cnt >= cache_capacity / 2 )
 	{
-		struct cache *c = list_entry(e, struct cache, elem) ;
-		if ( c->idx == idx )
-		{
-			result = true ;
-			break ;
-		}
+		g = list_entry(list_pop_front(&ghost_list), struct cache_ghost, elem) ;
+		hash_delete(&ghosts, &g->hash_elem) ;
+		ghost_cnt -- ;
 	}
+	else if ( !list_empty(&ghost_free) )
+		g = list_entry(list_pop_front(&ghost_free), struct cache_ghost, elem) ;
+	else
+		return ;
+
+	g->idx = idx ;
+	if ( hash_insert(&ghosts, &g->hash_elem) != NULL )
+	{
+		list_push_back(&ghost_free, &g->elem) ;
+		return ;
+	}
+	list_push_back(&ghost_list, &g->elem) ;
+	ghost_cnt ++ ;
+}
 
-	return result ;
+// Forget the ghost of the sector IDX. Returns true if there was one. Must be called with the CACHE lock held
+static bool ghost_remove ( block_sector_t idx )
+{
+	struct cache_ghost key ;
+	struct hash_elem *e ;
+
+	key.idx = idx ;
+	e = hash_delete(&ghosts, &key.hash_elem) ;
+	if ( e == NULL )
+		return false ;
+
+	struct cache_ghost *g = hash_entry(e, struct cache_ghost, hash_elem) ;
+	list_remove(&g->elem) ;
+	list_push_back(&ghost_free, &g->elem) ;
+	ghost_cnt -- ;
+	return true ;
+}
+
+// Add C to the clock. Must be called with the CACHE lock held
+static void cache_enqueue_hot ( struct cache *c )
+{
+	c->hot = true ;
+	list_push_back(&cache_list, &c->elem) ;
+	cache_cnt ++ ;
+}
+
+// Add C, which was just brought into the cache, to the lists of the replacement policy
+// With CACHE_2Q it goes to the FIFO of new blocks, unless it was evicted from it recently
+// Must be called with the CACHE lock held
+static void cache_admit ( struct cache *c )
+{
+	if ( cache_policy == CACHE_2Q && !ghost_remove(c->idx) )
+	{
+		c->hot = false ;
+		list_push_back(&cache_in, &c->elem) ;
+		cache_in_cnt ++ ;
+	}
+	else
+		cache_enqueue_hot(c) ;
+
+	if ( cache_cnt + cache_in_cnt > cache_peak )
+		cache_peak = cache_cnt + cache_in_cnt ;
+}
+
+// Take C out of the lists of the replacement policy. Must be called with the CACHE lock held
+static void cache_dequeue ( struct cache *c )
+{
+	list_remove(&c->elem) ;
+	if ( c->hot == true )
+		cache_cnt -- ;
+	else
+		cache_in_cnt -- ;
+}
+
+// Read the missing sectors of the pinned block C, which is in the CACHE_READING state, from the disk
+// Sectors being filled by a writer are left alone. Wakes up the threads waiting for the block
+static void cache_fill ( struct cache *c )
+{
+	struct cache_shard *s = cache_shard(c->idx) ;
+
+	lock_acquire(&s->lock) ;
+	uint32_t missing = cache_line_mask(c) & ~c->valid & ~c->filling ;
+	lock_release(&s->lock) ;
+
+	// A whole block is read with a single device request
+	cache_transfer(c, missing, false) ;
+
+	lock_acquire(&s->lock) ;
+	c->valid |= missing ;
+	c->state = CACHE_READY ;
+	cond_broadcast(&c->io_done, &s->lock) ;
+	lock_release(&s->lock) ;
+}
+
+// Mark SECTOR of the pinned block C, which the caller has just filled, valid and wake up the threads waiting for it
+static void cache_fill_done ( struct cache *c, block_sector_t sector )
+{
+	struct cache_shard *s = cache_shard(c->idx) ;
+	uint32_t bit = cache_sector_bit(c, sector) ;
+
+	lock_acquire(&s->lock) ;
+	c->valid |= bit ;
+	c->filling &= ~bit ;
+	cond_broadcast(&c->io_done, &s->lock) ;
+	lock_release(&s->lock) ;
+}
+
+// Add DELTA to the number of dirty blocks
+static void cache_count_dirty ( int delta )
+{
+	lock_acquire(&dirty_lock) ;
+	dirty_cnt += delta ;
+	lock_release(&dirty_lock) ;
+}
+
+// Returns true if more than cache_dirty_ratio percent of the cache is dirty
+// CACHE_CAPACITY is read without the CACHE lock: it only changes when a page is borrowed or given back, and a stale
+// value only moves the throttling threshold by one page
+static bool cache_over_dirty_ratio (void)
+{
+	lock_acquire(&dirty_lock) ;
+	bool over = dirty_cnt * 100 > cache_dirty_ratio * cache_capacity ;
+	lock_release(&dirty_lock) ;
+
+	return over ;
+}
+
+// Mark SECTOR of C dirty. Must be called with the lock of C's shard held
+static void cache_mark_dirty ( struct cache *c, block_sector_t sector )
+{
+	if ( c->dirty == 0 )
+	{
+		c->dirty_since = timer_ticks() ;
+		cache_count_dirty(1) ;
+	}
+	c->dirty |= cache_sector_bit(c, sector) ;
+}
+
+// Wake up the threads waiting in cache_allocate() for a block to become evictable
+// Called without any shard lock held, after the pin count of a block dropped to 0
+// CACHE_ALLOC_WAITERS is read without the CACHE lock: a waiter counts itself before its eviction pass looks at the
+// pin counts, so an unpin which that pass missed happens after it and sees the waiter
+static void cache_signal_unpin (void)
+{
+	if ( cache_alloc_waiters == 0 )
+		return ;
+
+	lock_acquire(&cache) ;
+	cache_unpin_gen ++ ;
+	cond_broadcast(&cache_unpinned, &cache) ;
+	lock_release(&cache) ;
+}
+
+// Drop the reference on C taken by get_cache_block() for SECTOR with CACHE_PIN, and mark SECTOR dirty if DIRTY is true
+static void cache_unpin ( struct cache *c, block_sector_t sector, bool dirty )
+{
+	struct cache_shard *s = cache_shard(c->idx) ;
+
+	lock_acquire(&s->lock) ;
+
+	if ( dirty == true )
+		cache_mark_dirty(c, sector) ;
+	bool idle = -- c->in_use == 0 ;
+
+	// cache_drop() waits for the other users of a block to be gone
+	cond_broadcast(&c->io_done, &s->lock) ;
+	lock_release(&s->lock) ;
+
+	if ( idle == true )
+		cache_signal_unpin() ;
+}
+
+// Returns true if access MODE to SECTOR of C can be granted now. Must be called with the lock of C's shard held
+static bool cache_can_access ( const struct cache *c, block_sector_t sector, enum cache_mode mode )
+{
+	if ( mode == CACHE_PIN )
+		return true ;
+	if ( c->writers & cache_sector_bit(c, sector) )
+		return false ;
+	return mode == CACHE_SHARED || c->readers[sector - c->idx] == 0 ;
+}
+
+// Grant access MODE to SECTOR of C. Must be called with the lock of C's shard held
+static void cache_take_access ( struct cache *c, block_sector_t sector, enum cache_mode mode )
+{
+	if ( mode == CACHE_SHARED )
+		c->readers[sector - c->idx] ++ ;
+	else if ( mode == CACHE_EXCLUSIVE )
+		c->writers |= cache_sector_bit(c, sector) ;
 }
 
-// Query the hash to find the cache block with key IDX
-// If not present, evict a cache block and create a new cache block with IDX and INODE information
-struct cache * get_cache_block ( block_sector_t idx, bool read )
+// Query the hash to find the cache block holding SECTOR
+// If not present, evict a cache block and create a new cache block for it
+// The returned block is pinned, with access MODE to SECTOR granted. If READ is false and SECTOR was not present,
+// SECTOR is returned invalid and the caller must fill it and mark it valid with cache_fill_done()
+struct cache * get_cache_block ( block_sector_t sector, bool read, enum cache_mode mode )
 {
-	// I acquire the lock before I check if the block is present in evict_list because:
-	// In between I release the lock EVICT and I acquire lock CACHE, someone else might come and evict IDX
-	// Hence I need to acquire the lock on cache and make sure no one else can evict IDX
-	lock_acquire(&cache);
+	block_sector_t idx = cache_line_start(sector) ;
+	struct cache_shard *s = cache_shard(idx) ;
+	struct cache *new = NULL ;
+	struct cache *c ;
+
+	// Only the shard of IDX is locked, so lookups of sectors in other shards never contend with this one
+	lock_acquire(&s->lock);
+	s->stats.lookups ++ ;
 
-	// Check if the block is about to be evicted from the buffer cache
-	// If so, sleep for 20 ticks and wait for it to be evicted
 	while ( 1 )
 	{
-		bool present ;
+		// Check if the block is already present in the buffer cache
+		c = cache_lookup(idx) ;
+		if ( c != NULL )
+			break ;
+
+		if ( new != NULL )
+			break ;
+
+		// Get a free block without holding the shard lock since the victims may belong to any shard
+		// IDX must be looked up again afterwards
+		lock_release(&s->lock);
+		new = cache_allocate() ;
+		lock_acquire(&s->lock);
+	}
 
-		lock_acquire(&evict) ;
-		present = search_block_in_evicted ( idx ) ;
-		lock_release(&evict) ;
+	if ( c != NULL )
+	{
+		uint32_t bit = cache_sector_bit(c, sector) ;
 
-		if ( present == true )
+		// Pin the block before waiting so that it is not freed under us.
+		// If it is being evicted, the evicting thread sees the pin after its write and puts the block back
+		c->in_use ++ ;
+
+		int64_t evict_start = c->state == CACHE_EVICTING ? timer_ticks() : -1 ;
+
+		// A lookup which waits for another thread to read the sector found nothing in memory. It is a miss
+		bool present = ( c->valid & bit ) != 0 ;
+
+		while ( c->state != CACHE_READY || ( c->filling & bit ) || !cache_can_access(c, sector, mode) )
+			cond_wait(&c->io_done, &s->lock) ;
+
+		if ( evict_start != -1 )
 		{
-			lock_release(&cache) ;
-			timer_sleep(12);
-			lock_acquire(&cache) ;
+			s->stats.evict_waits ++ ;
+			s->stats.evict_wait_ticks += timer_elapsed(evict_start) ;
 		}
+
+		cache_take_access(c, sector, mode) ;
+		c->accessed = true ;
+
+		bool hit = ( c->valid & bit ) != 0 ;
+		if ( hit == true && present == true )
+			s->stats.hits ++ ;
 		else
-			break ;
-	}
+			s->stats.misses ++ ;
 
-	// Check if the block is already present in the buffer cache
-	struct cache *lookup = cache_lookup(idx) ;
-	if ( lookup != NULL )
-	{
-		lookup->accessed = true ;
-		lookup->in_use ++ ;
+		if ( hit == false )
+		{
+			// The block is present but SECTOR was never read into it
+			if ( read == true )
+				c->state = CACHE_READING ;
+			else
+				c->filling |= bit ;
+		}
+
+		lock_release(&s->lock);
+
+		// Someone else brought IDX in while we were getting a free block
+		if ( new != NULL )
+			cache_free_block(new) ;
 
-		lock_release(&cache);
-		return lookup ;
+		if ( hit == false && read == true )
+			cache_fill(c) ;
+
+		return c ;
 	}
 
-	lookup = cache_allocate ( idx ) ;
+	// Insert the new block. Other threads asking for a sector which is being read wait on it
+	new->idx = idx ;
+	new->accessed = true ;
+	new->dirty = 0 ;
+	new->valid = 0 ;
+	new->filling = 0 ;
+	new->in_use = 1 ;
+	new->writers = 0 ;
+	memset ( new->readers, 0, sizeof new->readers ) ;
+	cache_take_access(new, sector, mode) ;
+	if ( read == true )
+		new->state = CACHE_READING ;
+	else
+	{
+		new->state = CACHE_READY ;
+		new->filling = cache_sector_bit(new, sector) ;
+	}
+	cache_insert(&new->hash_elem);
+	s->stats.misses ++ ;
 
-	lookup->accessed = true ;
-	lookup->in_use ++ ;
+	lock_release(&s->lock);
 
-	lock_release(&cache);
+	lock_acquire(&cache) ;
+	cache_admit(new) ;
+	lock_release(&cache) ;
 
+	// Actual read from the disk to the cache for the first time
 	if ( read == true )
+		cache_fill(new) ;
+
+	return new ;
+}
+
+#ifdef VM
+// Borrow a free page of the user pool and add its sectors to the free list
+// Returns false if the cache is at its maximum size or the user pool has no free frame
+// Frames are only taken from the user pool by frame_allocate(), which calls cache_shrink() to get them back
+static bool cache_grow (void)
+{
+	int i ;
+
+	lock_acquire(&cache) ;
+	bool room = cache_capacity + page_blocks <= cache_max_blocks ;
+	lock_release(&cache) ;
+
+	if ( room == false )
+		return false ;
+
+	void *kpage = palloc_get_page(PAL_USER) ;
+	if ( kpage == NULL )
+		return false ;
+
+	struct cache_page *p = malloc ( sizeof *p ) ;
+	if ( p == NULL )
+	{
+		palloc_free_page(kpage) ;
+		return false ;
+	}
+
+	p->kpage = kpage ;
+	for ( i = 0 ; i < page_blocks ; i ++ )
 	{
-		// Actual read from the disk to the cache for the first time
-		block_read ( fs_device, lookup->idx, lookup->kblock ) ;
+		p->blocks[i].kblock = (uint8_t *) kpage + i * cache_line_sectors * BLOCK_SECTOR_SIZE ;
+		p->blocks[i].state = CACHE_FREE ;
+		cond_init(&p->blocks[i].io_done) ;
 	}
 
-	return lookup ;
+	lock_acquire(&cache) ;
+	for ( i = 0 ; i < page_blocks ; i ++ )
+		list_push_back(&cache_free, &p->blocks[i].elem) ;
+	list_push_back(&cache_pages, &p->elem) ;
+	cache_capacity += page_blocks ;
+	lock_release(&cache) ;
+
+	return true ;
 }
+#endif
 
-// Allocate a cache block in the memory
-struct cache * cache_allocate ( block_sector_t idx )
+// Take a free cache block from the pool, evicting a block if none is free
+struct cache * cache_allocate (void)
 {
-	// Check the size of the buffer cache
-	int size = hash_size(&cache_blocks) ;
+	struct cache *c = NULL ;
 
-	// Evict a buffer cache if the size if more than the limit
-	if ( size >= MAX_BUFFER_CACHE )
+	lock_acquire(&cache) ;
+	cache_alloc_waiters ++ ;
+
+	while ( list_empty(&cache_free) )
 	{
-		// This will remove a cache entry both from the hash table and also from the list
-		// This is followed by creating a new cache entry for the given IDX sector
-		evict_cache() ;
+		unsigned gen = cache_unpin_gen ;
+		lock_release(&cache) ;
+
+#ifdef VM
+		// Use idle memory before throwing cached sectors away
+		bool evicted = cache_grow() || evict_cache() ;
+#else
+		bool evicted = evict_cache() ;
+#endif
+
+		lock_acquire(&cache) ;
+
+		// Every block is pinned. Pins are held for one copy or one disk I/O only, so wait for one to go
+		if ( evicted == false )
+			while ( cache_unpin_gen == gen && list_empty(&cache_free) )
+				cond_wait(&cache_unpinned, &cache) ;
 	}
 
-	struct cache *new = (struct cache*) malloc ( sizeof(struct cache) ) ;
-	if ( new == NULL )
-		PANIC("cache_allocate: Failed to allocate memory to cache");
+	c = list_entry(list_pop_front(&cache_free), struct cache, elem) ;
+	c->state = CACHE_READING ;
+	cache_alloc_waiters -- ;
+	lock_release(&cache) ;
 
-	new->kblock = malloc (BLOCK_SECTOR_SIZE) ;
-	if ( new->kblock == NULL )
-		PANIC("cache_allocate: Failed to allocate memory to block");
+	return c ;
+}
 
-	new->idx = idx ;
+// Return the cache block C, which is in neither the hash nor the clock list, to the pool
+void cache_free_block ( struct cache *c )
+{
+	lock_acquire(&cache) ;
+	c->state = CACHE_FREE ;
+	list_push_back(&cache_free, &c->elem) ;
+	cache_unpin_gen ++ ;
+	cond_broadcast(&cache_unpinned, &cache) ;
+	lock_release(&cache) ;
+}
 
-	/*new->inode = inode ;*/
-	new->accessed = false ;
-	new->dirty = false ;
-	new->in_use = 0 ;
+// Pin the sector IDX in the cache and return its data with access MODE, reading it from the disk if needed
+void * cache_get ( block_sector_t idx, enum cache_mode mode )
+{
+	ASSERT ( mode == CACHE_SHARED || mode == CACHE_EXCLUSIVE ) ;
 
-	cache_insert(&new->hash_elem);
-	list_push_back(&cache_list, &new->elem);
+	return cache_sector_data(get_cache_block(idx, true, mode), idx) ;
+}
 
-	return new ;
+// Release the access to the sector IDX taken by cache_get() and unpin its block. DIRTY marks the sector dirty
+void cache_put ( block_sector_t idx, bool dirty )
+{
+	struct cache_shard *s = cache_shard(cache_line_start(idx)) ;
+
+	lock_acquire(&s->lock) ;
+
+	// The block is pinned, so it is still there
+	struct cache *c = cache_lookup(cache_line_start(idx)) ;
+	ASSERT ( c != NULL ) ;
+
+	uint32_t bit = cache_sector_bit(c, idx) ;
+	if ( c->writers & bit )
+		c->writers &= ~bit ;
+	else
+	{
+		ASSERT ( dirty == false && c->readers[idx - c->idx] > 0 ) ;
+		c->readers[idx - c->idx] -- ;
+	}
+
+	if ( dirty == true )
+		cache_mark_dirty(c, idx) ;
+	bool idle = -- c->in_use == 0 ;
+
+	cond_broadcast(&c->io_done, &s->lock) ;
+	lock_release(&s->lock) ;
+
+	if ( idle == true )
+		cache_signal_unpin() ;
+}
+
+// Returns the access taken by read_cache() and write_cache() for a copy to or from ADDR
+// Kernel buffers get SHARED or EXCLUSIVE access, so that they never see a sector being updated in place through
+// cache_get(), as metadata is. User buffers only pin the block: a page fault on them must not wait for access to a
+// block. Only file data is ever copied to or from user memory, and file data is never updated in place
+static enum cache_mode cache_copy_mode ( const void *addr, bool write )
+{
+	if ( !is_kernel_vaddr(addr) )
+		return CACHE_PIN ;
+	return write == true ? CACHE_EXCLUSIVE : CACHE_SHARED ;
+}
+
+// Release the block C, which holds SECTOR, after a copy done with access MODE
+static void cache_copy_done ( struct cache *c, block_sector_t sector, enum cache_mode mode, bool dirty )
+{
+	if ( mode == CACHE_PIN )
+		cache_unpin(c, sector, dirty) ;
+	else
+		cache_put(sector, dirty) ;
 }
 
 // Read from the buffer cache of IDX to ADDR
 void read_cache ( block_sector_t idx, void *addr, off_t ofs, int size )
 {
-	/*printf ( "read_cache\n");*/
-	struct cache *c = get_cache_block(idx, true) ;
+	enum cache_mode mode = cache_copy_mode(addr, false) ;
+	struct cache *c = get_cache_block(idx, true, mode) ;
 
-	memcpy (addr, c->kblock + ofs, size ) ;
+	memcpy (addr, cache_sector_data(c, idx) + ofs, size ) ;
 
-	c->in_use -- ;
-	/*c->accessed = true ;*/
+	cache_copy_done(c, idx, mode, false) ;
 
 	return ;
 }
@@ -191,162 +814,802 @@ void read_cache ( block_sector_t idx, void *addr, off_t ofs, int size )
 // Write to the buffer cache of IDX from ADDR
 void write_cache ( block_sector_t idx, const void *addr, off_t ofs, int size, bool read_before_write )
 {
-	/*printf ( "write_cache\n");*/
-	struct cache *c = get_cache_block(idx, read_before_write) ;
+	// Throttle the writer while too much of the cache is dirty: it waits for, or does, a write-behind pass
+	if ( cache_over_dirty_ratio() )
+		cache_flush(false) ;
+
+	enum cache_mode mode = cache_copy_mode(addr, true) ;
+	struct cache *c = get_cache_block(idx, read_before_write, mode) ;
+	uint8_t *data = cache_sector_data(c, idx) ;
+
+	// Only the thread filling the sector can see it invalid
+	bool filling = ( c->valid & cache_sector_bit(c, idx) ) == 0 ;
 
-	if ( read_before_write == false && size != BLOCK_SECTOR_SIZE )
-		memset ( c->kblock , 0, BLOCK_SECTOR_SIZE ) ;
+	if ( filling && size != BLOCK_SECTOR_SIZE )
+		memset ( data, 0, BLOCK_SECTOR_SIZE ) ;
 
-	memcpy ( c->kblock + ofs, addr, size ) ;
+	memcpy ( data + ofs, addr, size ) ;
 
-	c->in_use -- ;
-	/*c->accessed = true ;*/
-	c->dirty = true ;
+	if ( filling )
+		cache_fill_done(c, idx) ;
+
+	cache_copy_done(c, idx, mode, true) ;
 
 	return ;
 }
 
+// Write back the dirty sectors among the CNT sectors starting at SECTOR now, in sector order, merging consecutive
+// sectors into single requests like a write-back pass
+void cache_sync_range ( block_sector_t sector, size_t cnt )
+{
+	block_sector_t end = sector + cnt ;
+	block_sector_t idx ;
+	int n = 0, i ;
+
+	lock_acquire(&flush_lock) ;
+
+	for ( idx = cache_line_start(sector) ; idx < end ; idx += cache_line_sectors )
+	{
+		struct cache_shard *s = cache_shard(idx) ;
+		struct cache *c ;
+
+		lock_acquire(&s->lock) ;
+
+		c = cache_lookup(idx) ;
+		if ( c != NULL && c->dirty != 0 )
+		{
+			// Pin the block first, so that an eviction in progress puts it back once its write is done
+			c->in_use ++ ;
+			while ( c->state != CACHE_READY )
+				cond_wait(&c->io_done, &s->lock) ;
+
+			// The sectors of the block which lie in the range
+			uint32_t mask = cache_line_mask(c) ;
+			if ( sector > idx )
+				mask &= ~( ( (uint32_t) 1 << ( sector - idx ) ) - 1 ) ;
+			if ( end - idx < (block_sector_t) cache_line_sectors )
+				mask &= ( (uint32_t) 1 << ( end - idx ) ) - 1 ;
+
+			// A writer modifying a sector meanwhile marks it dirty again once it is done
+			uint32_t dirty = c->dirty & mask ;
+			if ( dirty != 0 )
+			{
+				c->dirty &= ~dirty ;
+				if ( c->dirty == 0 )
+					cache_count_dirty(-1) ;
+				flush_batch[n] = c ;
+				flush_dirty[n++] = dirty ;
+				c = NULL ;
+			}
+		}
+		else
+			c = NULL ;
+
+		lock_release(&s->lock) ;
+
+		// Someone cleaned the block while we waited for it
+		if ( c != NULL )
+			cache_unpin(c, idx, false) ;
+
+		// The blocks are collected in sector order already
+		if ( n == cache_max_blocks || ( n > 0 && idx + cache_line_sectors >= end ) )
+		{
+			cache_write_batch(n) ;
+			for ( i = 0 ; i < n ; i ++ )
+				cache_unpin(flush_batch[i], flush_batch[i]->idx, false) ;
+			n = 0 ;
+		}
+	}
+
+	lock_release(&flush_lock) ;
+}
+
+// Drop the cached copy of the sector IDX, if any. It is read from the disk again on its next use
+static void cache_drop ( block_sector_t idx )
+{
+	block_sector_t start = cache_line_start(idx) ;
+	struct cache_shard *s = cache_shard(start) ;
+	bool idle = false ;
+
+	lock_acquire(&s->lock) ;
+
+	struct cache *c = cache_lookup(start) ;
+	if ( c != NULL )
+	{
+		uint32_t bit = cache_sector_bit(c, idx) ;
+
+		// A sector being read or filled is waited for, so that its old data does not come back afterwards
+		// So are the other threads holding the block: a writer which pinned it decides from VALID whether it
+		// fills the sector, and must not find it invalid unless it is the one filling it
+		c->in_use ++ ;
+		while ( c->state != CACHE_READY || ( c->filling & bit ) || c->in_use > 1 )
+			cond_wait(&c->io_done, &s->lock) ;
+
+		c->valid &= ~bit ;
+		if ( c->dirty & bit )
+		{
+			c->dirty &= ~bit ;
+			if ( c->dirty == 0 )
+				cache_count_dirty(-1) ;
+		}
+		idle = -- c->in_use == 0 ;
+	}
+
+	lock_release(&s->lock) ;
+
+	if ( idle == true )
+		cache_signal_unpin() ;
+}
+
+// Keep the cache coherent with a transfer of the CNT sectors starting at SECTOR which bypasses it
+// Before a read from the disk, the dirty sectors in the range are written back in merged requests. Taking
+// flush_lock to do so also waits for a write-back pass which has already cleaned them but not yet written them
+// Around a write to the disk, the cached copies in the range are dropped: before it, so that no dirty copy is
+// written over the new data, and after it, so that no copy read meanwhile outlives it
+void cache_bypass ( block_sector_t sector, size_t cnt, bool write )
+{
+	size_t i ;
+
+	if ( write == false )
+	{
+		cache_sync_range(sector, cnt) ;
+		return ;
+	}
+
+	for ( i = 0 ; i < cnt ; i ++ )
+		cache_drop(sector + i) ;
+}
+
 // Deallocate the cache block and write back to disk if necessary
 void cache_deallocate (block_sector_t idx)
 {
+	struct cache_shard *s = cache_shard(idx) ;
+
+	lock_acquire(&s->lock) ;
+
 	struct cache *c = cache_lookup(idx) ;
 	if ( c == NULL )
 		PANIC("cache_deallocate: Deallocating a cache block not present");
 
+	hash_delete(&s->blocks, &c->hash_elem);
+
+	lock_release(&s->lock) ;
+
 	// Acquire lock since you are modifying the cache block list
 	lock_acquire(&cache) ;
+	cache_dequeue(c) ;
+	lock_release(&cache) ;
 
-	hash_delete(&cache_blocks, &c->hash_elem);
-	list_remove(&c->elem);
+	release_block(c) ;
 
-	// Add this block to the list of evicting blocks
-	lock_acquire(&evict) ;
-	list_push_back(&evict_list, &c->elem) ;
-	lock_release(&evict) ;
+	return ;
+}
 
-	// No need to write asynchronously as it increases the memory consumption
-	// We do not get any performance as well
-	release_block(c) ;
+// Take C off the lists as a victim if it can be evicted in pass PASS of evict_cache(), and return true
+// The first pass only takes clean blocks. If CLOCK is true, a block accessed since the last round gets its accessed
+// flag cleared instead. Must be called with the CACHE lock held
+static bool cache_try_victim ( struct cache *c, int pass, bool clock )
+{
+	// Waiting for the shard lock while holding CACHE is safe: CACHE is never acquired with a shard lock held
+	struct cache_shard *s = cache_shard(c->idx) ;
+	lock_acquire(&s->lock) ;
 
-	/*[>Asynchrously write to the file system if required<]*/
-	/*tid_t tid ;*/
-	/*tid = thread_create("evict_cache", PRI_DEFAULT+1, release_block, c) ;*/
-	/*if ( tid == TID_ERROR )*/
-		/*PANIC("cache_deallocate: Not able to create a new thread");*/
+	bool victim = false ;
+	if ( clock == true && c->accessed == true )
+		c->accessed = false ;
+	else
+		victim = c->in_use == 0 && c->state == CACHE_READY && ( pass == 1 || c->dirty == 0 ) ;
 
-	lock_release(&cache) ;
+	if ( victim == true )
+	{
+		// Threads asking for this sector from now on wait for the write back instead of reading stale data
+		c->state = CACHE_EVICTING ;
+		cache_dequeue(c) ;
+	}
 
-	return ;
+	lock_release(&s->lock) ;
+
+	return victim ;
+}
+
+// Returns a victim taken from the clock in pass PASS of evict_cache(), or a null pointer
+// Must be called with the CACHE lock held
+static struct cache * cache_victim_clock ( int pass )
+{
+	// Two rounds of the clock are enough to clear every accessed bit once
+	int tries = cache_cnt * 2 ;
+	while ( tries -- > 0 )
+	{
+		struct list_elem *e = list_pop_front(&cache_list) ;
+		list_push_back(&cache_list, e) ;
+
+		struct cache *c = list_entry(e, struct cache, elem) ;
+		if ( cache_try_victim(c, pass, true) )
+			return c ;
+	}
+
+	return NULL ;
 }
 
-// Evict a cache block using clock algorithm and free the memory occupied by it
-void evict_cache (void)
+// Returns the oldest block of the FIFO of new blocks which can be evicted in pass PASS of evict_cache(), or a null
+// pointer. Its sector is remembered as a ghost. Must be called with the CACHE lock held
+static struct cache * cache_victim_in ( int pass )
 {
 	struct list_elem *e ;
+
+	for ( e = list_begin(&cache_in) ; e != list_end(&cache_in) ; e = list_next(e) )
+	{
+		struct cache *c = list_entry(e, struct cache, elem) ;
+		if ( cache_try_victim(c, pass, false) )
+		{
+			ghost_add(c->idx) ;
+			return c ;
+		}
+	}
+
+	return NULL ;
+}
+
+// Evict a cache block using the replacement policy and return it to the pool
+// Returns false if every cache block is in use and nothing could be evicted
+bool evict_cache (void)
+{
+	struct cache *c = NULL ;
+	int pass ;
+
+	lock_acquire(&cache) ;
+
+	// The first pass only takes clean blocks, which the flusher keeps the majority of the cache
+	// Dirty blocks are evicted only when no clean block can be found
+	for ( pass = 0 ; pass < 2 && c == NULL ; pass ++ )
+	{
+		// 2Q takes new blocks first while they hold more than a quarter of the cache, so that blocks read once
+		// by a scan are thrown away before the hot blocks in the clock
+		if ( cache_policy == CACHE_2Q && cache_in_cnt > cache_capacity / 4 )
+			c = cache_victim_in(pass) ;
+		if ( c == NULL )
+			c = cache_victim_clock(pass) ;
+		if ( c == NULL && cache_policy == CACHE_2Q )
+			c = cache_victim_in(pass) ;
+	}
+
+	lock_release(&cache) ;
+
+	if ( c == NULL )
+		return false ;
+
+	if ( cache_evict_block(c) )
+		cache_free_block(c) ;
+
+	return true ;
+}
+
+// Pin the block starting at sector IDX if it is present, idle and dirty, and take its dirty sectors for write-back
+// Returns the block, or a null pointer. Must be called with FLUSH_LOCK held
+static struct cache * cache_take_neighbour ( block_sector_t idx, uint32_t *dirty )
+{
+	struct cache_shard *s = cache_shard(idx) ;
 	struct cache *c ;
 
-	while ( 1 )
+	lock_acquire(&s->lock) ;
+
+	c = cache_lookup(idx) ;
+	if ( c == NULL || c->state != CACHE_READY || c->dirty == 0 )
+		c = NULL ;
+	else
 	{
-		e = list_pop_front(&cache_list) ;
-		c = list_entry(e, struct cache, elem) ;
+		c->in_use ++ ;
+		*dirty = c->dirty ;
+		c->dirty = 0 ;
+		cache_count_dirty(-1) ;
+		s->stats.flusher_writes ++ ;
+	}
+
+	lock_release(&s->lock) ;
+
+	return c ;
+}
+
+// Write back the dirty sectors of the block C, which is being evicted, together with the dirty blocks right before
+// and after it on the disk, so that a single request writes the whole run
+// Falls back to writing C alone if a write-back pass is in progress
+static void cache_write_cluster ( struct cache *c, uint32_t dirty )
+{
+	int max = CACHE_WRITE_RUN / cache_line_sectors ;
+	int before = 0, n = 0, i ;
 
-		if ( c->accessed == true )
+	if ( max > cache_max_blocks )
+		max = cache_max_blocks ;
+
+	if ( max <= 1 || lock_held_by_current_thread(&flush_lock) || !lock_try_acquire(&flush_lock) )
+	{
+		cache_transfer(c, dirty, true) ;
+		return ;
+	}
+
+	// Walk away from C in both directions until a block which is not dirty
+	block_sector_t idx = c->idx ;
+	while ( n < max - 1 && idx >= (block_sector_t) cache_line_sectors )
+	{
+		idx -= cache_line_sectors ;
+		struct cache *b = cache_take_neighbour(idx, &flush_dirty[n]) ;
+		if ( b == NULL )
+			break ;
+		flush_batch[n++] = b ;
+	}
+	before = n ;
+
+	flush_batch[n] = c ;
+	flush_dirty[n++] = dirty ;
+
+	idx = c->idx ;
+	while ( n < max )
+	{
+		idx += cache_line_sectors ;
+		struct cache *b = cache_take_neighbour(idx, &flush_dirty[n]) ;
+		if ( b == NULL )
+			break ;
+		flush_batch[n++] = b ;
+	}
+
+	// The blocks before C were collected backwards
+	for ( i = 0 ; i < before / 2 ; i ++ )
+	{
+		struct cache *b = flush_batch[i] ;
+		uint32_t d = flush_dirty[i] ;
+
+		flush_batch[i] = flush_batch[before - 1 - i] ;
+		flush_dirty[i] = flush_dirty[before - 1 - i] ;
+		flush_batch[before - 1 - i] = b ;
+		flush_dirty[before - 1 - i] = d ;
+	}
+
+	cache_write_batch(n) ;
+
+	for ( i = 0 ; i < n ; i ++ )
+		if ( flush_batch[i] != c )
+			cache_unpin(flush_batch[i], flush_batch[i]->idx, false) ;
+
+	lock_release(&flush_lock) ;
+}
+
+// Write back the block C, which has been taken off the clock list in the CACHE_EVICTING state, and remove it from the hash
+// Returns false if a thread started waiting for C meanwhile. C is then put back in the cache
+static bool cache_evict_block ( struct cache *c )
+{
+	struct cache_shard *s ;
+	uint32_t dirty = c->dirty ;
+
+	// Write the dirty sectors back without holding any lock
+	if ( dirty != 0 )
+		cache_write_cluster(c, dirty) ;
+
+	s = cache_shard(c->idx) ;
+	lock_acquire(&s->lock) ;
+
+	if ( c->dirty != 0 )
+	{
+		c->dirty = 0 ;
+		cache_count_dirty(-1) ;
+	}
+
+	// Someone started waiting for this block while it was being written. Its data is still valid, so keep it
+	if ( c->in_use != 0 )
+	{
+		c->state = CACHE_READY ;
+		c->accessed = true ;
+		cond_broadcast(&c->io_done, &s->lock) ;
+		lock_release(&s->lock) ;
+
+		lock_acquire(&cache) ;
+		cache_enqueue_hot(c) ;
+		lock_release(&cache) ;
+
+		return false ;
+	}
+
+	hash_delete(&s->blocks, &c->hash_elem);
+	if ( dirty != 0 )
+		s->stats.dirty_evictions ++ ;
+	else
+		s->stats.clean_evictions ++ ;
+	lock_release(&s->lock) ;
+
+	return true ;
+}
+
+// Take the block C of a page being given back out of the cache
+// Returns true if C holds no sector and is in no list anymore
+static bool cache_reclaim ( struct cache *c )
+{
+	bool victim = false ;
+
+	lock_acquire(&cache) ;
+
+	if ( c->state == CACHE_FREE )
+	{
+		list_remove(&c->elem) ;
+		c->state = CACHE_EVICTING ;
+		lock_release(&cache) ;
+		return true ;
+	}
+
+	// C is only trusted to hold IDX if it is found under IDX with the lock of IDX's shard held
+	block_sector_t idx = c->idx ;
+	struct cache_shard *s = cache_shard(idx) ;
+	if ( lock_try_acquire(&s->lock) )
+	{
+		if ( cache_lookup(idx) == c && c->state == CACHE_READY && c->in_use == 0 )
 		{
-			c->accessed = false ;
-			list_push_back(&cache_list, e) ;
+			c->state = CACHE_EVICTING ;
+			cache_dequeue(c) ;
+			victim = true ;
 		}
-		else
+		lock_release(&s->lock) ;
+	}
+
+	lock_release(&cache) ;
+
+	return victim && cache_evict_block(c) ;
+}
+
+// Give the most recently borrowed page back to the user pool, evicting the blocks it holds
+// Returns true if a page was freed, false if no page is borrowed or one of its blocks is in use
+bool cache_shrink (void)
+{
+	struct cache_page *p ;
+	bool reclaimed[CACHE_PAGE_SECTORS] ;
+	bool success = true ;
+	int i ;
+
+	lock_acquire(&cache) ;
+	if ( list_empty(&cache_pages) )
+	{
+		lock_release(&cache) ;
+		return false ;
+	}
+	p = list_entry(list_pop_back(&cache_pages), struct cache_page, elem) ;
+	lock_release(&cache) ;
+
+	for ( i = 0 ; i < page_blocks ; i ++ )
+	{
+		reclaimed[i] = cache_reclaim(&p->blocks[i]) ;
+		if ( reclaimed[i] == false )
+			success = false ;
+	}
+
+	if ( success == false )
+	{
+		// Keep the page. The blocks taken out of the cache go back to the free list
+		for ( i = 0 ; i < page_blocks ; i ++ )
+			if ( reclaimed[i] == true )
+				cache_free_block(&p->blocks[i]) ;
+
+		lock_acquire(&cache) ;
+		list_push_back(&cache_pages, &p->elem) ;
+		lock_release(&cache) ;
+
+		return false ;
+	}
+
+	lock_acquire(&cache) ;
+	cache_capacity -= page_blocks ;
+	lock_release(&cache) ;
+
+	palloc_free_page(p->kpage) ;
+	free(p) ;
+
+	return true ;
+}
+
+// Release the block from the buffer cache. Write this block to disk if it is dirty
+// The block must already be removed from the hash and from the clock list
+void release_block ( void *aux )
+{
+	struct cache *c = (struct cache *) aux ;
+
+	if ( c->dirty != 0 )
+		cache_transfer(c, c->dirty, true) ;
+
+	c->dirty = 0 ;
+	cache_free_block(c) ;
+
+	return ;
+}
+
+// Orders two pointers to cache blocks by sector number
+static int cache_sector_cmp ( const void *a_, const void *b_ )
+{
+	const struct cache *a = *(struct cache * const *) a_ ;
+	const struct cache *b = *(struct cache * const *) b_ ;
+
+	return a->idx < b->idx ? -1 : a->idx > b->idx ;
+}
+
+// Write the dirty sectors FLUSH_DIRTY[I] of the first N blocks of FLUSH_BATCH, which is sorted by sector
+// Consecutive sectors are gathered in WRITE_BUF, even across blocks, and written with a single request
+// Must be called with FLUSH_LOCK held
+static void cache_write_batch ( int n )
+{
+	block_sector_t start = 0 ;
+	int cnt = 0, i, j ;
+
+	for ( i = 0 ; i < n ; i ++ )
+	{
+		struct cache *c = flush_batch[i] ;
+
+		for ( j = 0 ; j < cache_line_sectors ; j ++ )
 		{
-			if ( c->in_use != 0 )
-				list_push_back(&cache_list, e) ;
-			else
+			block_sector_t sector = c->idx + j ;
+
+			if ( ( flush_dirty[i] & ( (uint32_t) 1 << j ) ) == 0 )
+				continue ;
+
+			if ( cnt > 0 && ( sector != start + cnt || cnt == CACHE_WRITE_RUN ) )
 			{
-				hash_delete(&cache_blocks, &c->hash_elem);
+				block_write_multiple(fs_device, start, cnt, write_buf) ;
+				cnt = 0 ;
+			}
+			if ( cnt == 0 )
+				start = sector ;
+
+			memcpy ( write_buf + cnt * BLOCK_SECTOR_SIZE, cache_sector_data(c, sector), BLOCK_SECTOR_SIZE ) ;
+			cnt ++ ;
+		}
+	}
+
+	if ( cnt > 0 )
+		block_write_multiple(fs_device, start, cnt, write_buf) ;
+}
+
+// Write back the dirty blocks older than cache_dirty_age in sector order
+// Every dirty block is written if ALL is true or if the dirty ratio is exceeded
+void cache_flush ( bool all )
+{
+	struct cache **batch = flush_batch ;
+	struct list_elem *e ;
+	int n = 0, i ;
 
-				// Add this block to the list of evicting blocks
-				lock_acquire(&evict) ;
-				list_push_back(&evict_list, &c->elem) ;
-				lock_release(&evict) ;
+	lock_acquire(&flush_lock) ;
 
-				// Write the block to the cache here itself.
-				// No need to create a new thread as it increases the work and memory
-				release_block(c) ;
+	if ( cache_closed == true )
+	{
+		lock_release(&flush_lock) ;
+		return ;
+	}
 
-				/*// Asynchronously write the block to the file system*/
-				/*tid_t tid ;*/
-				/*tid = thread_create( "evict_cache", PRI_DEFAULT+1, release_block, c) ;*/
-				/*if ( tid == TID_ERROR )*/
-					/*PANIC("evict_cache: Couldn't create a thread for release_block");*/
+	// A throttled writer which waited for another pass may find nothing left to do
+	int64_t now = timer_ticks() ;
+	bool over = cache_over_dirty_ratio() ;
 
-				break ;
+	// Pin the blocks to write so that they are not evicted while the CACHE lock is dropped
+	struct list *lists[] = { &cache_list, &cache_in } ;
+	lock_acquire(&cache) ;
+	for ( i = 0 ; i < 2 ; i ++ )
+		for ( e = list_begin(lists[i]) ; e != list_end(lists[i]) && n < cache_max_blocks ; e = list_next(e) )
+		{
+			struct cache *c = list_entry(e, struct cache, elem) ;
+			struct cache_shard *s = cache_shard(c->idx) ;
+
+			lock_acquire(&s->lock) ;
+			if ( c->dirty != 0 && c->state == CACHE_READY
+					&& ( all || over || now - c->dirty_since >= cache_dirty_age ) )
+			{
+				c->in_use ++ ;
+				batch[n++] = c ;
 			}
+			lock_release(&s->lock) ;
+		}
+	lock_release(&cache) ;
+
+	// Write in sector order to keep the disk head moving in one direction
+	qsort(batch, n, sizeof *batch, cache_sector_cmp) ;
+
+	// Clear the dirty flags before writing. A writer modifying a block meanwhile marks it dirty again
+	// once it is done, so its data is written by a later pass
+	for ( i = 0 ; i < n ; i ++ )
+	{
+		struct cache_shard *s = cache_shard(batch[i]->idx) ;
+
+		lock_acquire(&s->lock) ;
+		flush_dirty[i] = batch[i]->dirty ;
+		if ( flush_dirty[i] != 0 )
+		{
+			batch[i]->dirty = 0 ;
+			cache_count_dirty(-1) ;
+			s->stats.flusher_writes ++ ;
 		}
+		lock_release(&s->lock) ;
 	}
 
-	return ;
+	cache_write_batch(n) ;
+
+	for ( i = 0 ; i < n ; i ++ )
+		cache_unpin(batch[i], batch[i]->idx, false) ;
+
+	lock_release(&flush_lock) ;
 }
 
-// ASYNCHRONOUSLY Release the block from the buffer cache. Write this block to disk if it is dirty
-void release_block ( void *aux )
+// Write-behind thread. Periodically writes back the blocks which have been dirty for too long
+static void cache_flusher ( void *aux UNUSED )
 {
-	struct cache *c = (struct cache *) aux ;
+	while ( cache_closed == false )
+	{
+		timer_sleep(CACHE_FLUSH_INTERVAL) ;
+		cache_flush(false) ;
+	}
+}
 
-	if ( c->dirty == true )
-		block_write(fs_device, c->idx, c->kblock) ;
+// Ask the read-ahead thread to bring the sector IDX into the buffer cache
+// The request is dropped if too many requests are already pending
+void cache_readahead ( block_sector_t idx )
+{
+	lock_acquire(&readahead_lock) ;
 
-	// REMOVE this block from the list of evicting blocks
-	lock_acquire(&evict) ;
-	list_remove(&c->elem) ;
-	lock_release(&evict) ;
+	if ( readahead_cnt < READAHEAD_QUEUE && readahead_closed == false )
+	{
+		readahead_queue[(readahead_head + readahead_cnt) % READAHEAD_QUEUE] = idx ;
+		readahead_cnt ++ ;
+		cond_broadcast(&readahead_cond, &readahead_lock) ;
+	}
 
-	free(c->kblock) ;
-	free(c);
+	lock_release(&readahead_lock) ;
+}
 
-	return ;
+// Read the block holding the sector IDX into the cache if it is not already present
+static void cache_prefetch ( block_sector_t idx )
+{
+	struct cache_shard *s = cache_shard(cache_line_start(idx)) ;
+	bool present ;
+
+	lock_acquire(&s->lock) ;
+	present = cache_lookup(cache_line_start(idx)) != NULL ;
+	lock_release(&s->lock) ;
+
+	if ( present == true )
+		return ;
+
+	// A reader asking for IDX meanwhile finds it in the CACHE_READING state and waits for this read
+	struct cache *c = get_cache_block(idx, true, CACHE_PIN) ;
+	cache_unpin(c, idx, false) ;
+}
+
+// Read-ahead thread. Serves the requests queued by cache_readahead() in order
+static void cache_reader ( void *aux UNUSED )
+{
+	while ( 1 )
+	{
+		lock_acquire(&readahead_lock) ;
+
+		readahead_busy = false ;
+		cond_broadcast(&readahead_cond, &readahead_lock) ;
+
+		while ( readahead_cnt == 0 && readahead_closed == false )
+			cond_wait(&readahead_cond, &readahead_lock) ;
+
+		if ( readahead_closed == true )
+		{
+			lock_release(&readahead_lock) ;
+			return ;
+		}
+
+		block_sector_t idx = readahead_queue[readahead_head] ;
+		readahead_head = (readahead_head + 1) % READAHEAD_QUEUE ;
+		readahead_cnt -- ;
+		readahead_busy = true ;
+
+		lock_release(&readahead_lock) ;
+
+		cache_prefetch(idx) ;
+	}
 }
 
 // Remove all the cache blocks in memory and write the dirty blocks to disk
 // NO NEED to do this asynchronously
 void release_cache (void)
 {
-	struct list_elem *e, *next ;
+	// Stop the flusher. Waiting for FLUSH_LOCK makes sure no write-behind pass still holds pinned blocks
+	lock_acquire(&flush_lock) ;
+	cache_closed = true ;
+	lock_release(&flush_lock) ;
 
-	for ( e = list_begin(&cache_list) ; e != list_end(&cache_list) ; e = next )
-	{
-		next = list_next(e) ;
-		struct cache *c = list_entry(e, struct cache, elem) ;
+	// Stop the read-ahead thread and wait till it is done with the sector it is reading
+	lock_acquire(&readahead_lock) ;
+	readahead_closed = true ;
+	cond_broadcast(&readahead_cond, &readahead_lock) ;
+	while ( readahead_busy == true )
+		cond_wait(&readahead_cond, &readahead_lock) ;
+	lock_release(&readahead_lock) ;
+
+	// Take every block out of the cache, then write all the dirty sectors in one sorted, merged pass
+	struct list *lists[] = { &cache_list, &cache_in } ;
+	int n = 0, i ;
+
+	lock_acquire(&flush_lock) ;
 
-		cache_deallocate(c->idx) ;
+	lock_acquire(&cache) ;
+	for ( i = 0 ; i < 2 ; i ++ )
+		while ( !list_empty(lists[i]) )
+		{
+			struct cache *c = list_entry(list_front(lists[i]), struct cache, elem) ;
+			struct cache_shard *s = cache_shard(c->idx) ;
 
-		/*hash_delete(&cache_blocks, &c->hash_elem);*/
-		/*list_remove(&c->elem);*/
+			cache_dequeue(c) ;
 
-		/*if ( c->dirty == true )*/
-			/*block_write(fs_device, c->idx, c->kblock) ;*/
+			lock_acquire(&s->lock) ;
+			hash_delete(&s->blocks, &c->hash_elem) ;
+			lock_release(&s->lock) ;
 
-		/*free(c->kblock) ;*/
-		/*free(c);*/
-	}
+			flush_batch[n++] = c ;
+		}
+	lock_release(&cache) ;
+
+	qsort(flush_batch, n, sizeof *flush_batch, cache_sector_cmp) ;
+	for ( i = 0 ; i < n ; i ++ )
+		flush_dirty[i] = flush_batch[i]->dirty ;
 
-	lock_acquire(&cache);
+	cache_write_batch(n) ;
 
-	for ( e = list_begin(&evict_list) ; e != list_end(&evict_list) ; e = next )
+	for ( i = 0 ; i < n ; i ++ )
 	{
-		next = list_next(e) ;
-		struct cache *c = list_entry(e, struct cache, elem) ;
+		flush_batch[i]->dirty = 0 ;
+		cache_free_block(flush_batch[i]) ;
+	}
+
+	lock_release(&flush_lock) ;
 
-		release_block(c) ;
+	return ;
+}
+
+// Add the counters of a shard S to STATS
+static void cache_add_stats ( struct cache_stats *stats, const struct cache_stats *s )
+{
+	stats->lookups += s->lookups ;
+	stats->hits += s->hits ;
+	stats->misses += s->misses ;
+	stats->clean_evictions += s->clean_evictions ;
+	stats->dirty_evictions += s->dirty_evictions ;
+	stats->flusher_writes += s->flusher_writes ;
+	stats->evict_waits += s->evict_waits ;
+	stats->evict_wait_ticks += s->evict_wait_ticks ;
+}
 
-		/*list_remove(&c->elem);*/
+// Store the counters of the cache in STATS
+void cache_get_stats ( struct cache_stats *stats )
+{
+	int i ;
 
-		/*if ( c->dirty == true )*/
-			/*block_write(fs_device, c->idx, c->kblock) ;*/
+	memset ( stats, 0, sizeof *stats ) ;
 
-		/*free(c->kblock) ;*/
-		/*free(c);*/
+	for ( i = 0 ; i < CACHE_SHARDS ; i ++ )
+	{
+		lock_acquire(&cache_shards[i].lock) ;
+		cache_add_stats(stats, &cache_shards[i].stats) ;
+		lock_release(&cache_shards[i].lock) ;
 	}
 
-	lock_release(&cache);
+	lock_acquire(&cache) ;
+	stats->blocks = cache_cnt + cache_in_cnt ;
+	stats->peak_blocks = cache_peak ;
+	lock_release(&cache) ;
+}
 
-	return ;
+// Print the counters of the cache
+// Called at shutdown, possibly on a panic, so no lock is taken
+void cache_print_stats (void)
+{
+	struct cache_stats stats ;
+	int i ;
+
+	memset ( &stats, 0, sizeof stats ) ;
+	for ( i = 0 ; i < CACHE_SHARDS ; i ++ )
+		cache_add_stats(&stats, &cache_shards[i].stats) ;
+
+	printf ("Buffer cache: %s policy, %lld lookups, %lld hits (%lld%%), %lld misses, peak %d blocks\n",
+			cache_policy == CACHE_2Q ? "2Q" : "clock", stats.lookups, stats.hits,
+			stats.lookups > 0 ? stats.hits * 100 / stats.lookups : 0, stats.misses, cache_peak) ;
+	printf ("Buffer cache: %lld clean and %lld dirty evictions, %lld write-behind writes, "
+			"%lld waits for evicting blocks (%lld ticks)\n",
+			stats.clean_evictions, stats.dirty_evictions, stats.flusher_writes,
+			stats.evict_waits, stats.evict_wait_ticks) ;
 }
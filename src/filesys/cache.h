@@ -4,30 +4,120 @@
 #include <hash.h>
 #include "threads/synch.h"
 #include "devices/block.h"
-#include <hash.h>
 #include "filesys/off_t.h"
+#include "devices/timer.h"
+#include "threads/vaddr.h"
+#include <cache-stats.h>
+
+// Default number of sectors the cache always holds. Can be set from the kernel command line
+#define CACHE_DEFAULT_SIZE 64
+
+// Default number of sectors the cache may grow to by borrowing free pages of the user pool
+#define CACHE_DEFAULT_MAX 1024
+
+// Number of sector buffers in one page
+#define CACHE_PAGE_SECTORS (PGSIZE / BLOCK_SECTOR_SIZE)
+
+// Number of independently locked partitions of the cache hash table
+#define CACHE_SHARDS 16
+
+// Most sectors written back with a single disk request
+#define CACHE_WRITE_RUN 32
+
+// Timer ticks between two write-behind passes of the flusher thread
+#define CACHE_FLUSH_INTERVAL TIMER_FREQ
+
+// Default age in timer ticks after which a dirty block is written back by the flusher
+#define CACHE_DIRTY_AGE (2 * TIMER_FREQ)
+
+// Default percentage of the cache which may be dirty before writers are throttled
+#define CACHE_DIRTY_RATIO 50
+
+// Maximum number of read-ahead requests waiting for the read-ahead thread
+#define READAHEAD_QUEUE 32
 
-#define MAX_BUFFER_CACHE 64
+// Write-behind tunables. Can be set from the kernel command line
+extern int cache_dirty_age ;
+extern int cache_dirty_ratio ;
+
+// Size of the cache in sectors: the part allocated at boot and the maximum it may grow to
+extern int cache_size ;
+extern int cache_max_size ;
+
+// Number of sectors held by each cache block: 1, or CACHE_PAGE_SECTORS when the cache is made of page-sized lines
+// read and written back with one disk request. Can be set from the kernel command line
+extern int cache_line_sectors ;
+
+// Replacement policy of the cache
+enum cache_policy
+{
+	CACHE_CLOCK,							// A single clock over every block
+	CACHE_2Q								// 2Q: new blocks go through a FIFO, and only the sectors asked for again
+											// soon after leaving it enter the clock. Scans never push hot blocks out
+} ;
+
+// Replacement policy in use. Can be set from the kernel command line
+extern enum cache_policy cache_policy ;
+
+// State of the data held by a cache block
+enum cache_state
+{
+	CACHE_READY,							// Block holds valid data and can be used
+	CACHE_READING,							// Block is being filled from the disk
+	CACHE_EVICTING,							// Block is being written back to the disk before it is freed
+	CACHE_FREE								// Block holds no sector and is in the free list
+} ;
+
+// Access to the data of a cache block granted by get_cache_block()
+enum cache_mode
+{
+	CACHE_PIN,								// Pinned only. Used by read_cache() and write_cache() for user buffers
+	CACHE_SHARED,							// Read the data in place. Any number of threads may share it
+	CACHE_EXCLUSIVE							// Read and modify the data in place. Excludes every other SHARED or EXCLUSIVE user
+} ;
+
+// Partition of the BUFFER CACHE. The block starting at sector IDX always lives in shard
+// IDX / cache_line_sectors % CACHE_SHARDS
+struct cache_shard
+{
+	struct hash blocks ;					// Cache blocks of this shard, keyed by sector number
+	struct lock lock ;						// Lock protecting BLOCKS and the state of every block in it
+
+	struct cache_stats stats ;				// Counters of the sectors of this shard. Protected by LOCK
+											// The block counts are kept for the whole cache, under the CACHE lock
+} ;
 
 // BUFFER CACHE Blocks
-struct hash cache_blocks ;
+extern struct cache_shard cache_shards[CACHE_SHARDS] ;
 
-// Lock to access the cache blocks
-struct lock cache ;
+// Lock to access the lists of cache blocks used by the eviction algorithm
+// Lock order: the flusher's FLUSH_LOCK, then CACHE, then a shard lock, then DIRTY_LOCK
+// A shard lock may be acquired while holding CACHE, but CACHE is never acquired while holding a shard lock
+extern struct lock cache ;
 
-// List of all the cache blocks in memory
-struct list cache_list ;
+// List of the cache blocks scanned by the clock. With CACHE_2Q, the blocks in the FIFO of new blocks are not in it
+extern struct list cache_list ;
 
 // Cache block table entry
 struct cache
 {
-	block_sector_t idx ;					// HASH KEY. Sector number on the disk this block belongs to
+	block_sector_t idx ;					// HASH KEY. First sector on the disk of the cache_line_sectors held by this block
 
 	void *kblock ;							// Kernel block which stores the block data
 
 	bool accessed ;							// Accessed flag
-	bool dirty ;							// Dirty flag
+	bool hot ;								// True if in CACHE_LIST, false if in the FIFO of new blocks of CACHE_2Q
+	uint32_t valid ;						// Mask of the sectors holding the data of the disk. Bit I is sector IDX + I
+	uint32_t dirty ;						// Mask of the dirty sectors
+	uint32_t filling ;						// Mask of the sectors being filled by a writer without reading them first
+	int64_t dirty_since ;					// Timer tick at which the block became dirty
 	int in_use ;							// Number of processes currently using this cache block
+	uint16_t readers[CACHE_PAGE_SECTORS] ;	// Number of threads holding CACHE_SHARED access to each sector
+	uint32_t writers ;						// Mask of the sectors to which a thread holds CACHE_EXCLUSIVE access
+
+	enum cache_state state ;				// I/O in progress on this block, if any
+	struct condition io_done ;				// Signalled with the shard lock held when the I/O on this block completes
+											// or when access to it is released
 
 	struct hash_elem hash_elem ;			// Hash element for storing cache block in the hash
 	struct list_elem elem ;					// List element for the list used for eviction algorithm
@@ -42,35 +132,78 @@ unsigned cache_hash (const struct hash_elem *p_, void *aux UNUSED) ;
 /* Returns true if cache block a precedes cache block b. */
 bool cache_less (const struct hash_elem *a_, const struct hash_elem *b_, void *aux UNUSED) ;
 
-/* Returns the cache block containing the given file system block ID, or a null pointer if no such cache block exists. */
+/* Returns the cache block containing the given file system block ID, or a null pointer if no such cache block exists.
+   Must be called with the lock of IDX's shard held. */
 struct cache * cache_lookup (block_sector_t idx) ;
 
 // Insert an element into the cache block
 struct hash_elem * cache_insert ( struct hash_elem *new ) ;
 
-// Query the hash to find the cache block with key IDX
-// If not present, evict a cache block and create a new cache block with IDX and INODE information
-struct cache * get_cache_block ( block_sector_t idx, bool read ) ;
+// Query the hash to find the cache block holding SECTOR
+// If not present, evict a cache block and create a new cache block for it
+// The block is returned pinned, with access MODE to SECTOR granted
+struct cache * get_cache_block ( block_sector_t sector, bool read, enum cache_mode mode ) ;
+
+// Pin the sector IDX in the cache and return its data, reading it from the disk if needed
+// The data is used in place, with MODE being CACHE_SHARED or CACHE_EXCLUSIVE
+// No user memory may be touched while holding the sector: a page fault could need the same block
+void * cache_get ( block_sector_t idx, enum cache_mode mode ) ;
 
-// Allocate a cache block in the memory
-struct cache * cache_allocate ( block_sector_t idx ) ;
+// Release the access to the sector IDX taken by cache_get() and unpin its block
+// DIRTY marks the sector dirty, and requires CACHE_EXCLUSIVE access
+void cache_put ( block_sector_t idx, bool dirty ) ;
+
+// Take a free cache block from the pool, evicting a block if none is free
+struct cache * cache_allocate (void) ;
+
+// Return a cache block which holds no sector to the pool
+void cache_free_block ( struct cache *c ) ;
 
 // Read from a block IDX in the buffer cache to ADDR
+// A copy to kernel memory holds CACHE_SHARED access to IDX, so it never sees a sector updated in place half-done
 void read_cache ( block_sector_t idx, void *addr, off_t ofs, int size ) ;
 
 // Write to the block IDX in the buffer cache from ADDR
+// A copy from kernel memory holds CACHE_EXCLUSIVE access to IDX, like a thread updating it in place
 void write_cache ( block_sector_t idx, const void *addr, off_t ofs, int size, bool read_before_write ) ;
 
+// Write back the dirty sectors among the CNT sectors starting at SECTOR now, with as few disk requests as possible
+void cache_sync_range ( block_sector_t sector, size_t cnt ) ;
+
+// Keep the cache coherent with a transfer of the CNT sectors starting at SECTOR which bypasses it
+// Before a read from the disk, the dirty sectors in the range are written back
+// Around a write to the disk, the cached copies in the range are dropped
+void cache_bypass ( block_sector_t sector, size_t cnt, bool write ) ;
+
 // Deallocate the cache block and write back to disk if necessary
 void cache_deallocate (block_sector_t idx) ;
 
-// Evict a cache block using clock algorithm and return the free cache block
-void evict_cache (void) ;
+// Evict a cache block using clock algorithm
+// Returns false if every cache block is in use and nothing could be evicted
+bool evict_cache (void) ;
 
-// Asynchronously write the block to the file system and free the cache block in memory
+// Write the block to the file system if it is dirty and return the cache block to the pool
 void release_block ( void *aux ) ;
 
+// Ask the read-ahead thread to bring the sector IDX into the buffer cache
+// The request is dropped if too many requests are already pending
+void cache_readahead ( block_sector_t idx ) ;
+
+// Write back the dirty blocks older than cache_dirty_age in sector order
+// If ALL is true, write back every dirty block
+void cache_flush ( bool all ) ;
+
+// Give one page borrowed from the user pool back to it, evicting the blocks it holds
+// Returns true if a page was freed
+bool cache_shrink (void) ;
+
 // Release all the cache blocks in memory and write the dirty blocks to disk
 void release_cache (void) ;
 
+// Store the counters of the cache in STATS
+void cache_get_stats ( struct cache_stats *stats ) ;
+
+// Print the counters of the cache
+void cache_print_stats (void) ;
+
 #endif
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <list.h>
+#include <hash.h>
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
@@ -9,6 +10,441 @@
 #include "threads/thread.h"
 #include "threads/interrupt.h"
 #include "filesys/free-map.h"
+#include "filesys/cache.h"
+
+/* Cursor over the entries of a directory.  The sector holding
+   the current entry stays pinned in the buffer cache, so that
+   entries are read in place instead of copied one at a time. */
+struct dir_cursor
+  {
+    struct inode *inode;                /* Directory being scanned. */
+    void *block;                        /* Data of the pinned sector, or null. */
+    block_sector_t sector;              /* Sector of BLOCK. */
+    off_t block_ofs;                    /* Byte offset of BLOCK. */
+    struct dir_entry copy;              /* Entry spanning two sectors. */
+  };
+
+/* Starts a scan of the directory INODE. */
+static void
+cursor_init (struct dir_cursor *c, struct inode *inode)
+{
+  c->inode = inode;
+  c->block = NULL;
+  c->block_ofs = 0;
+}
+
+/* Unpins the sector held by C.  Must be called before writing
+   to the directory and when done with the scan. */
+static void
+cursor_done (struct dir_cursor *c)
+{
+  if (c->block != NULL)
+    {
+      cache_put (c->sector, false);
+      c->block = NULL;
+    }
+}
+
+/* Returns the directory entry at byte offset OFS, or a null
+   pointer at end of directory.  The entry is only valid until
+   the next call on C. */
+static const struct dir_entry *
+cursor_entry (struct dir_cursor *c, off_t ofs)
+{
+  int sector_ofs = ofs % BLOCK_SECTOR_SIZE;
+  off_t block_ofs = ofs - sector_ofs;
+
+  if (ofs + (off_t) sizeof c->copy > inode_length (c->inode))
+    return NULL;
+
+  /* Entries do not divide a sector evenly.  Copy the ones which
+     span two sectors, and the ones of a small directory, which
+     are inline in its inode. */
+  if (sector_ofs + sizeof c->copy > BLOCK_SECTOR_SIZE
+      || inode_is_inline (c->inode))
+    {
+      if (inode_read_at (c->inode, &c->copy, sizeof c->copy, ofs)
+          != sizeof c->copy)
+        return NULL;
+      return &c->copy;
+    }
+
+  if (c->block == NULL || c->block_ofs != block_ofs)
+    {
+      cursor_done (c);
+      c->block = inode_get_block (c->inode, block_ofs, CACHE_SHARED,
+                                  &c->sector);
+      if (c->block == NULL)
+        return NULL;
+      c->block_ofs = block_ofs;
+    }
+  return (const struct dir_entry *) ((uint8_t *) c->block + sector_ofs);
+}
+
+/* Hash index of a large directory.
+
+   Once a directory has DIR_INDEX_MIN entry slots, the hashes of
+   its names are kept in a file of its own, recorded with its
+   number of buckets in the directory's inode.  The entries stay
+   where they are, so that reading the directory does not change.
+   Sector 0 of the index holds a header, and the next BUCKET_CNT
+   sectors the buckets.  A bucket which fills up chains to
+   overflow sectors appended to the index, and the index is
+   rebuilt twice as large when the buckets are three quarters
+   full on average.  The free entries of the directory are
+   chained through their INODE_SECTOR, so that adding, finding and
+   removing an entry each read a few sectors, whatever the size of
+   the directory.  An index which exists always lists every entry
+   in use: a change it cannot follow fails. */
+
+#define INDEX_MAGIC 0x494e4458          /* Identifies an index. */
+#define INDEX_NONE ((uint32_t) -1)      /* End of the free entry chain. */
+#define INDEX_MIN_BUCKETS 4             /* Fewest buckets in an index. */
+
+/* Entry of a bucket. */
+struct index_slot
+  {
+    uint32_t hash;                      /* Hash of the name. */
+    uint32_t ofs;                       /* Offset of the directory entry. */
+  };
+
+/* Number of entries in one bucket sector. */
+#define INDEX_SLOTS ((BLOCK_SECTOR_SIZE - 8) / sizeof (struct index_slot))
+
+/* Bucket sector of an index. */
+struct index_bucket
+  {
+    uint32_t cnt;                       /* Slots in use. */
+    uint32_t next;                      /* Offset of the overflow sector, or 0. */
+    struct index_slot slots[INDEX_SLOTS];
+  };
+
+/* Header of an index, at its start. */
+struct index_header
+  {
+    unsigned magic;                     /* INDEX_MAGIC. */
+    uint32_t entry_cnt;                 /* Entries in the buckets. */
+    uint32_t free_ofs;                  /* First free entry, or INDEX_NONE. */
+  };
+
+/* Returns the index of DIR, which the caller must close, and sets
+   *BUCKET_CNT to its number of buckets.  Returns a null pointer if
+   DIR has no index or if it cannot be opened. */
+static struct inode *
+index_open (const struct dir *dir, uint32_t *bucket_cnt)
+{
+  *bucket_cnt = inode_index_buckets (dir->inode);
+  return inode_open_index (dir->inode);
+}
+
+/* Reads the header of INDEX into *H. */
+static bool
+index_read_header (struct inode *index, struct index_header *h)
+{
+  return inode_read_at (index, h, sizeof *h, 0) == sizeof *h
+         && h->magic == INDEX_MAGIC;
+}
+
+/* Writes header H back to INDEX. */
+static bool
+index_write_header (struct inode *index, const struct index_header *h)
+{
+  return inode_write_at (index, h, sizeof *h, 0) == sizeof *h;
+}
+
+/* Opens the index of DIR like index_open() and reads its header
+   into *H.  Returns a null pointer if DIR has no index or if it
+   cannot be used. */
+static struct inode *
+index_open_header (const struct dir *dir, uint32_t *bucket_cnt,
+                   struct index_header *h)
+{
+  struct inode *index = index_open (dir, bucket_cnt);
+
+  if (index != NULL && !index_read_header (index, h))
+    {
+      inode_close (index);
+      index = NULL;
+    }
+  return index;
+}
+
+/* Returns the offset in an index of BUCKET_CNT buckets of the
+   bucket for HASH. */
+static off_t
+index_bucket (uint32_t bucket_cnt, unsigned hash)
+{
+  return (off_t) (1 + (hash & (bucket_cnt - 1))) * BLOCK_SECTOR_SIZE;
+}
+
+/* Searches INDEX, of BUCKET_CNT buckets, of DIR for NAME, like
+   lookup(). */
+static bool
+index_find (struct inode *index, uint32_t bucket_cnt, const struct dir *dir,
+            const char *name, struct dir_entry *ep, off_t *ofsp)
+{
+  unsigned hash = hash_string (name);
+  off_t pos = index_bucket (bucket_cnt, hash);
+  struct dir_cursor c;
+  bool found = false;
+
+  cursor_init (&c, dir->inode);
+  while (pos != 0 && !found)
+    {
+      block_sector_t sector;
+      const struct index_bucket *b = inode_get_block (index, pos,
+                                                      CACHE_SHARED, &sector);
+      uint32_t i;
+
+      if (b == NULL)
+        break;
+      for (i = 0; i < b->cnt && !found; i++)
+        if (b->slots[i].hash == hash)
+          {
+            const struct dir_entry *e = cursor_entry (&c, b->slots[i].ofs);
+            if (e != NULL && e->in_use && !strcmp (name, e->name))
+              {
+                if (ep != NULL)
+                  *ep = *e;
+                if (ofsp != NULL)
+                  *ofsp = b->slots[i].ofs;
+                found = true;
+              }
+          }
+      pos = b->next;
+      cache_put (sector, false);
+    }
+  cursor_done (&c);
+  return found;
+}
+
+/* Adds the entry at offset OFS, whose name hashes to HASH, to
+   INDEX, of BUCKET_CNT buckets, chaining an overflow sector to
+   its bucket if full. */
+static bool
+index_insert (struct inode *index, uint32_t bucket_cnt, unsigned hash,
+              off_t ofs)
+{
+  off_t pos = index_bucket (bucket_cnt, hash);
+
+  for (;;)
+    {
+      block_sector_t sector;
+      struct index_bucket *b = inode_get_block (index, pos, CACHE_EXCLUSIVE,
+                                                &sector);
+      off_t next;
+      uint32_t zero = 0;
+
+      if (b == NULL)
+        return false;
+      if (b->cnt < INDEX_SLOTS)
+        {
+          b->slots[b->cnt].hash = hash;
+          b->slots[b->cnt].ofs = ofs;
+          b->cnt++;
+          cache_put (sector, true);
+          return true;
+        }
+      next = b->next;
+      cache_put (sector, false);
+      if (next == 0)
+        {
+          /* Grow the index by a zeroed sector and link it. */
+          next = inode_length (index);
+          if (inode_write_at (index, &zero, sizeof zero,
+                              next + BLOCK_SECTOR_SIZE - sizeof zero)
+              != sizeof zero)
+            return false;
+          b = inode_get_block (index, pos, CACHE_EXCLUSIVE, &sector);
+          if (b == NULL)
+            return false;
+          b->next = next;
+          cache_put (sector, true);
+        }
+      pos = next;
+    }
+}
+
+/* Removes the entry at offset OFS, whose name hashes to HASH,
+   from INDEX, of BUCKET_CNT buckets. */
+static void
+index_delete (struct inode *index, uint32_t bucket_cnt, unsigned hash,
+              off_t ofs)
+{
+  off_t pos = index_bucket (bucket_cnt, hash);
+
+  while (pos != 0)
+    {
+      block_sector_t sector;
+      struct index_bucket *b = inode_get_block (index, pos, CACHE_EXCLUSIVE,
+                                                &sector);
+      uint32_t i;
+
+      if (b == NULL)
+        return;
+      for (i = 0; i < b->cnt; i++)
+        if (b->slots[i].ofs == (uint32_t) ofs)
+          {
+            b->slots[i] = b->slots[--b->cnt];
+            cache_put (sector, true);
+            return;
+          }
+      pos = b->next;
+      cache_put (sector, false);
+    }
+}
+
+/* Removes the index file in SECTOR. */
+static void
+index_remove (block_sector_t sector)
+{
+  struct inode *index = inode_open (sector);
+
+  if (index != NULL)
+    {
+      inode_remove (index);
+      inode_close (index);
+    }
+}
+
+/* Builds a new index of DIR, sized for the entry slots it has,
+   and replaces the old one, if any.  On failure, DIR keeps the
+   index it had. */
+static bool
+index_build (struct dir *dir)
+{
+  off_t slot_cnt = inode_length (dir->inode) / sizeof (struct dir_entry);
+  uint32_t bucket_cnt = INDEX_MIN_BUCKETS;
+  struct index_header h;
+  struct dir_cursor c;
+  const struct dir_entry *e;
+  struct dir_entry free_entry;
+  struct inode *index = NULL;
+  block_sector_t sector = 0, old;
+  off_t ofs;
+  bool success = true;
+
+  while (bucket_cnt * INDEX_SLOTS < (size_t) slot_cnt * 2)
+    bucket_cnt *= 2;
+  h.magic = INDEX_MAGIC;
+  h.entry_cnt = 0;
+  h.free_ofs = INDEX_NONE;
+
+  if (!free_map_allocate_near (inode_get_inumber (dir->inode), &sector))
+    return false;
+  if (!inode_create (sector, (off_t) (bucket_cnt + 1) * BLOCK_SECTOR_SIZE,
+                     false))
+    {
+      free_map_release (sector, 1);
+      return false;
+    }
+  index = inode_open (sector);
+  if (index == NULL)
+    return false;
+
+  /* Index the entries in use and chain the free ones.  The
+     sector is unpinned before a free entry is rewritten. */
+  cursor_init (&c, dir->inode);
+  for (ofs = 0; success && (e = cursor_entry (&c, ofs)) != NULL;
+       ofs += sizeof *e)
+    if (e->in_use)
+      {
+        success = index_insert (index, bucket_cnt, hash_string (e->name),
+                                ofs);
+        h.entry_cnt++;
+      }
+    else
+      {
+        free_entry = *e;
+        cursor_done (&c);
+        free_entry.inode_sector = h.free_ofs;
+        success = inode_write_at (dir->inode, &free_entry, sizeof free_entry,
+                                  ofs) == sizeof free_entry;
+        h.free_ofs = ofs;
+      }
+  cursor_done (&c);
+
+  if (success)
+    success = index_write_header (index, &h);
+  if (!success)
+    {
+      inode_remove (index);
+      inode_close (index);
+      return false;
+    }
+  inode_close (index);
+
+  old = inode_get_index (dir->inode);
+  inode_set_index (dir->inode, sector, bucket_cnt);
+  if (old != 0)
+    index_remove (old);
+  return true;
+}
+
+/* Drops the index of directory INODE, if any. */
+static void
+index_drop (struct inode *inode)
+{
+  block_sector_t sector = inode_get_index (inode);
+
+  if (sector != 0)
+    {
+      inode_set_index (inode, 0, 0);
+      index_remove (sector);
+    }
+}
+
+/* Writes entry E of DIR, indexed by INDEX of BUCKET_CNT buckets
+   with header H, into a free entry or at the end of DIR.  On
+   failure, DIR, INDEX and H are left as they were, except for a
+   slot appended to DIR, which stays free. */
+static bool
+index_add (struct dir *dir, struct inode *index, uint32_t bucket_cnt,
+           struct index_header *h, const struct dir_entry *e)
+{
+  unsigned hash = hash_string (e->name);
+  struct index_header old = *h;
+  struct dir_entry slot;
+  off_t ofs;
+
+  /* The head of the free chain, which links through the
+     INODE_SECTOR of free entries only. */
+  if (h->free_ofs != INDEX_NONE)
+    {
+      ofs = h->free_ofs;
+      if (inode_read_at (dir->inode, &slot, sizeof slot, ofs) != sizeof slot)
+        return false;
+      ASSERT (!slot.in_use);
+      h->free_ofs = slot.inode_sector;
+    }
+  else
+    {
+      ofs = inode_length (dir->inode);
+      slot = *e;
+      slot.in_use = false;
+    }
+  h->entry_cnt++;
+
+  if (!index_insert (index, bucket_cnt, hash, ofs))
+    {
+      *h = old;
+      return false;
+    }
+  if (inode_write_at (dir->inode, e, sizeof *e, ofs) != sizeof *e)
+    {
+      index_delete (index, bucket_cnt, hash, ofs);
+      *h = old;
+      return false;
+    }
+  if (!index_write_header (index, h))
+    {
+      index_delete (index, bucket_cnt, hash, ofs);
+      inode_write_at (dir->inode, &slot, sizeof slot, ofs);
+      *h = old;
+      return false;
+    }
+  return true;
+}
 
 /* Creates a directory with space for ENTRY_CNT entries in the
    given SECTOR.  Returns true if successful, false on failure. */
@@ -103,22 +539,37 @@ bool
 lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp) 
 {
-  struct dir_entry e;
+  struct dir_cursor c;
+  const struct dir_entry *e;
+  struct inode *index;
+  uint32_t bucket_cnt;
   size_t ofs;
   
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (e.in_use && !strcmp (name, e.name)) 
+  /* A large directory is searched through its index.  If the
+     index cannot be opened, the entries are all there still. */
+  index = index_open (dir, &bucket_cnt);
+  if (index != NULL)
+    {
+      bool found = index_find (index, bucket_cnt, dir, name, ep, ofsp);
+      inode_close (index);
+      return found;
+    }
+
+  cursor_init (&c, dir->inode);
+  for (ofs = 0; (e = cursor_entry (&c, ofs)) != NULL; ofs += sizeof *e) 
+    if (e->in_use && !strcmp (name, e->name)) 
       {
         if (ep != NULL)
-          *ep = e;
+          *ep = *e;
         if (ofsp != NULL)
           *ofsp = ofs;
+        cursor_done (&c);
         return true;
       }
+  cursor_done (&c);
   /*printf ( "Lookup failed\n");*/
   return false;
 }
@@ -159,7 +610,12 @@ dir_lookup (const struct dir *dir, const char *name,
 bool
 dir_add (struct dir *dir, const char *name, block_sector_t inode_sector, bool isdir)
 {
+  struct dir_cursor c;
+  const struct dir_entry *slot;
   struct dir_entry e;
+  struct index_header h;
+  struct inode *index;
+  uint32_t bucket_cnt;
   off_t ofs;
   bool success = false;
 
@@ -174,23 +630,48 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector, bool is
   if (lookup (dir, name, NULL, NULL))
     goto done;
 
+  e.in_use = true;
+  strlcpy (e.name, name, sizeof e.name);
+  e.inode_sector = inode_sector;
+  e.isdir = isdir ;
+
+  /* Index the directory once it is large, and index it anew once
+     its buckets fill up or if its index cannot be used.  If that
+     fails, the old index is kept, or the directory is searched
+     linearly. */
+  index = index_open_header (dir, &bucket_cnt, &h);
+  if (index != NULL
+      ? h.entry_cnt * 4 >= bucket_cnt * INDEX_SLOTS * 3
+      : inode_get_index (dir->inode) != 0
+        || inode_length (dir->inode) >= DIR_INDEX_MIN * (off_t) sizeof e)
+    {
+      inode_close (index);
+      index_build (dir);
+      index = index_open_header (dir, &bucket_cnt, &h);
+    }
+
+  /* An entry added linearly would be missing from the index. */
+  if (index == NULL && inode_get_index (dir->inode) != 0)
+    goto done;
+  if (index != NULL)
+    {
+      success = index_add (dir, index, bucket_cnt, &h, &e);
+      inode_close (index);
+      goto done;
+    }
+
   /* Set OFS to offset of free slot.
      If there are no free slots, then it will be set to the
      current end-of-file.
-     
-     inode_read_at() will only return a short read at end of file.
-     Otherwise, we'd need to verify that we didn't get a short
-     read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (!e.in_use)
+
+     The sector is unpinned before the slot is written. */
+  cursor_init (&c, dir->inode);
+  for (ofs = 0; (slot = cursor_entry (&c, ofs)) != NULL; ofs += sizeof e) 
+    if (!slot->in_use)
       break;
+  cursor_done (&c);
 
   /* Write slot. */
-  e.in_use = true;
-  strlcpy (e.name, name, sizeof e.name);
-  e.inode_sector = inode_sector;
-  e.isdir = isdir ;
   success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
   /*printf ( "Success: %d\n", success) ;*/
 
@@ -257,6 +738,9 @@ dir_remove (struct dir *dir, const char *name)
 {
   struct dir_entry e;
   struct inode *inode = NULL;
+  struct index_header h;
+  struct inode *index = NULL;
+  uint32_t bucket_cnt;
   bool success = false;
   off_t ofs;
 
@@ -267,6 +751,12 @@ dir_remove (struct dir *dir, const char *name)
   if (!lookup (dir, name, &e, &ofs))
     goto done;
 
+  /* An entry removed behind the back of the index would be
+     reused while the index still lists it. */
+  index = index_open_header (dir, &bucket_cnt, &h);
+  if (index == NULL && inode_get_index (dir->inode) != 0)
+    goto done;
+
   /* Open inode. */
   inode = inode_open (e.inode_sector);
   if (inode == NULL)
@@ -283,6 +773,8 @@ dir_remove (struct dir *dir, const char *name)
 	  struct dir *rmdir = dir_open(inode) ;
 
 	  bool res = dir_remove_dir(rmdir) ;
+	  if ( res == true )
+		  index_drop(inode) ;
 	  free(rmdir) ;
 	  /*dir_close(rmdir) ;*/
 
@@ -291,9 +783,28 @@ dir_remove (struct dir *dir, const char *name)
 		  goto done;
   }
 
-  /* Erase directory entry. */
+  /* Erase directory entry.  In a directory with an index, it
+     goes to the head of the free entries, linked through its
+     INODE_SECTOR.  The header is written first, so that a failure
+     leaves nothing changed. */
   e.in_use = false;
-  if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e) 
+  if (index != NULL)
+    {
+      struct index_header old = h;
+
+      e.inode_sector = h.free_ofs;
+      h.free_ofs = ofs;
+      h.entry_cnt--;
+      if (!index_write_header (index, &h))
+        goto done;
+      if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
+        {
+          index_write_header (index, &old);
+          goto done;
+        }
+      index_delete (index, bucket_cnt, hash_string (e.name), ofs);
+    }
+  else if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e) 
     goto done;
 
   // Remove the inode only when . and .. are not there
@@ -303,6 +814,7 @@ dir_remove (struct dir *dir, const char *name)
 
   /*printf ( "before close\n") ;*/
  done:
+  inode_close (index);
   inode_close (inode);
   return success;
 }
@@ -313,37 +825,45 @@ dir_remove (struct dir *dir, const char *name)
 bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
 {
-  struct dir_entry e;
+  struct dir_cursor c;
+  const struct dir_entry *e;
 
-  while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
+  cursor_init (&c, dir->inode);
+  while ((e = cursor_entry (&c, dir->pos)) != NULL) 
     {
-      dir->pos += sizeof e;
-      if (e.in_use)
+      dir->pos += sizeof *e;
+      if (e->in_use)
         {
-          strlcpy (name, e.name, NAME_MAX + 1);
+          strlcpy (name, e->name, NAME_MAX + 1);
+          cursor_done (&c);
           return true;
         } 
     }
+  cursor_done (&c);
   return false;
 }
 
 bool
 dir_readdir_without_dot (struct dir *dir, char name[NAME_MAX + 1])
 {
-  struct dir_entry e;
+  struct dir_cursor c;
+  const struct dir_entry *e;
 
-  while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
+  cursor_init (&c, dir->inode);
+  while ((e = cursor_entry (&c, dir->pos)) != NULL) 
     {
-      dir->pos += sizeof e;
-      if (e.in_use)
+      dir->pos += sizeof *e;
+      if (e->in_use)
         {
-			if ( strcmp(e.name,".") == 0 || strcmp(e.name,"..") == 0 )
+			if ( strcmp(e->name,".") == 0 || strcmp(e->name,"..") == 0 )
 				continue ;
 
-			strlcpy (name, e.name, NAME_MAX + 1) ;
+			strlcpy (name, e->name, NAME_MAX + 1) ;
+			cursor_done (&c) ;
 			return true;
         } 
     }
+  cursor_done (&c);
   return false;
 }
 
@@ -364,7 +884,7 @@ bool dir_mkdir ( char *path )
 
 	block_sector_t inode_sector = 0 ;
 	success = (dir != NULL
-			&& free_map_allocate (1, &inode_sector)
+			&& free_map_allocate_dir (&inode_sector)
 			&& dir_create (inode_sector, 16, dir)
 			&& dir_add (dir, name, inode_sector, true));
 
@@ -507,17 +1027,20 @@ bool verify_path ( char *path, struct dir **dir, char **file_name, bool open_fil
 
 int dir_size ( const struct dir *dir )
 {
-	struct dir_entry e;
+	struct dir_cursor c ;
+	const struct dir_entry *e;
 	size_t ofs;
 
 	ASSERT (dir != NULL);
 
 	int size = 0 ;
-	for ( ofs = 0 ; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e ; ofs += sizeof e )
+	cursor_init ( &c, dir->inode ) ;
+	for ( ofs = 0 ; (e = cursor_entry (&c, ofs)) != NULL ; ofs += sizeof *e )
 	{
-		if ( e.in_use )
+		if ( e->in_use )
 			size ++ ;
 	}
+	cursor_done ( &c ) ;
 
 	return size ;
 }
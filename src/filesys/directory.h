@@ -14,6 +14,10 @@
    retained, but much longer full path names must be allowed. */
 #define NAME_MAX 14
 
+/* Number of entry slots from which a directory gets a hash index
+   of its names.  Smaller directories are searched linearly. */
+#define DIR_INDEX_MIN 64
+
 struct inode;
 
 /* A directory. */
@@ -27,7 +31,11 @@ struct dir
 /* A single directory entry. */
 struct dir_entry 
   {
-    block_sector_t inode_sector;        /* Sector number of header. */
+    block_sector_t inode_sector;        /* Sector number of header.  In a free
+                                           entry of a directory with an index,
+                                           offset of the next free entry, or
+                                           INDEX_NONE; check IN_USE before
+                                           taking it as a sector. */
     char name[NAME_MAX + 1];            /* Null terminated file name. */
     bool in_use;                        /* In use or free? */
 
@@ -9,6 +9,7 @@ struct file
     struct inode *inode;        /* File's inode. */
     off_t pos;                  /* Current position. */
     bool deny_write;            /* Has file_deny_write() been called? */
+    struct readahead ra;        /* Sequential read-ahead state. */
   };
 
 /* Opens a file for the given INODE, of which it takes ownership,
@@ -69,7 +70,8 @@ file_get_inode (struct file *file)
 off_t
 file_read (struct file *file, void *buffer, off_t size) 
 {
-  off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
+  off_t bytes_read = inode_read_at_ra (file->inode, buffer, size, file->pos,
+                                      &file->ra);
   file->pos += bytes_read;
   return bytes_read;
 }
@@ -82,7 +84,7 @@ file_read (struct file *file, void *buffer, off_t size)
 off_t
 file_read_at (struct file *file, void *buffer, off_t size, off_t file_ofs) 
 {
-  return inode_read_at (file->inode, buffer, size, file_ofs);
+  return inode_read_at_ra (file->inode, buffer, size, file_ofs, &file->ra);
 }
 
 /* Writes SIZE bytes from BUFFER into FILE,
@@ -143,6 +145,15 @@ file_allow_write (struct file *file)
     }
 }
 
+/* Reserves space on the disk for FILE to grow to LENGTH bytes.
+   Returns true if successful, false if the disk is full. */
+bool
+file_reserve (struct file *file, off_t length)
+{
+  ASSERT (file != NULL);
+  return inode_reserve (file->inode, length);
+}
+
 /* Returns the size of FILE in bytes. */
 off_t
 file_length (struct file *file) 
@@ -44,11 +44,13 @@ filesys_init (bool format)
 void
 filesys_done (void) 
 {
+  // Write back the inodes still in memory and the free map before the cache is released
+  inode_done () ;
+  free_map_close ();
+
   // Release the buffer cache and write all the dirty blocks to the disk
   release_cache() ;
   free_zeros() ;
-
-  free_map_close ();
 }
 
 /* Creates a file named NAME with the given INITIAL_SIZE.
@@ -69,7 +71,8 @@ filesys_create (struct dir *dir, const char *name, off_t initial_size)
 
   block_sector_t inode_sector = 0;
   bool success = (dir != NULL
-                  && free_map_allocate (1, &inode_sector)
+                  && free_map_allocate_near (
+                       inode_get_inumber (dir_get_inode (dir)), &inode_sector)
                   && inode_create (inode_sector, initial_size, false)
                   && dir_add (dir, name, inode_sector, false));
   if (!success && inode_sector != 0) 
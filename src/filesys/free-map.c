@@ -4,9 +4,252 @@
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/cache.h"
+#include "threads/synch.h"
+#include "threads/malloc.h"
+#include <round.h>
+
+/* Bits of the free map held by one sector of the free map file. */
+#define SECTOR_BITS (BLOCK_SECTOR_SIZE * 8)
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct bitmap *free_map_dirty; /* Sectors of the free map file
+                                        changed since last written. */
+static struct lock free_map_lock;    /* Protects FREE_MAP and FREE_MAP_DIRTY,
+                                        and the allocation groups below. */
+
+/* Sectors in one allocation group.  The free map file holds the
+   bits of one group per sector. */
+#define GROUP_SECTORS SECTOR_BITS
+
+/* Groups tried past the first one holding a shorter free run
+   before a run allocation settles for the longest one seen. */
+#define FREE_MAP_SCAN_GROUPS 4
+
+static size_t group_cnt;             /* Number of allocation groups. */
+static size_t *group_free;           /* Free sectors in each group. */
+static block_sector_t next_fit;      /* Where the next allocation without
+                                        a hint starts looking. */
+static size_t next_group;            /* Group where the search for the next
+                                        directory starts. */
+
+/* Reads the free map from the free map file, copying each sector
+   straight out of the buffer cache.  Returns true if successful,
+   false otherwise. */
+static bool
+free_map_load (void)
+{
+  struct inode *inode = file_get_inode (free_map_file);
+  size_t size = bitmap_file_size (free_map);
+  size_t ofs;
+
+  for (ofs = 0; ofs < size; ofs += BLOCK_SECTOR_SIZE)
+    {
+      size_t chunk = size - ofs < BLOCK_SECTOR_SIZE ? size - ofs
+                                                    : BLOCK_SECTOR_SIZE;
+      block_sector_t sector;
+      void *data = inode_get_block (inode, ofs, CACHE_SHARED, &sector);
+      if (data == NULL)
+        return false;
+      bitmap_read_buf (free_map, data, ofs, chunk);
+      cache_put (sector, false);
+    }
+  return true;
+}
+
+/* Writes the sectors of the free map file which changed since
+   they were last written, or all of them if ALL is true.  They
+   are copied straight into the buffer cache and then written to
+   the disk together, one request per run of sectors, so that the
+   sectors allocated reach the disk before any inode which points
+   to them.  Returns true if successful, false
+   otherwise. */
+static bool
+free_map_store (bool all)
+{
+  struct inode *inode = file_get_inode (free_map_file);
+  size_t size = bitmap_file_size (free_map);
+  size_t ofs, i;
+  block_sector_t run = 0;
+  size_t run_cnt = 0;
+
+  for (ofs = 0, i = 0; ofs < size; ofs += BLOCK_SECTOR_SIZE, i++)
+    {
+      size_t chunk = size - ofs < BLOCK_SECTOR_SIZE ? size - ofs
+                                                    : BLOCK_SECTOR_SIZE;
+      block_sector_t sector;
+
+      if (!all && !bitmap_test (free_map_dirty, i))
+        continue;
+      void *data = inode_get_block (inode, ofs, CACHE_EXCLUSIVE, &sector);
+      if (data == NULL)
+        return false;
+      bitmap_write_buf (free_map, data, ofs, chunk);
+      cache_put (sector, true);
+      bitmap_reset (free_map_dirty, i);
+
+      /* Sectors consecutive on the disk are written together. */
+      if (run_cnt > 0 && sector != run + run_cnt)
+        {
+          cache_sync_range (run, run_cnt);
+          run_cnt = 0;
+        }
+      if (run_cnt++ == 0)
+        run = sector;
+    }
+  if (run_cnt > 0)
+    cache_sync_range (run, run_cnt);
+  return true;
+}
+
+/* Marks the sectors of the free map file holding the bits of the
+   CNT sectors starting at SECTOR as changed. */
+static void
+free_map_touch (block_sector_t sector, size_t cnt)
+{
+  size_t first = sector / SECTOR_BITS;
+  size_t last = (sector + cnt - 1) / SECTOR_BITS;
+
+  bitmap_set_multiple (free_map_dirty, first, last - first + 1, true);
+}
+
+/* Sets the CNT sectors starting at SECTOR to USED in the free
+   map, all of which must be set to !USED, and keeps the free
+   counts of their groups up to date.  Must be called with
+   FREE_MAP_LOCK held, or before the free map is shared. */
+static void
+free_map_mark (block_sector_t sector, size_t cnt, bool used)
+{
+  block_sector_t end = sector + cnt;
+  block_sector_t s;
+
+  ASSERT (used ? bitmap_none (free_map, sector, cnt)
+               : bitmap_all (free_map, sector, cnt));
+  bitmap_set_multiple (free_map, sector, cnt, used);
+  free_map_touch (sector, cnt);
+
+  for (s = sector; s < end; s = ROUND_DOWN (s, GROUP_SECTORS) + GROUP_SECTORS)
+    {
+      block_sector_t group_end = ROUND_DOWN (s, GROUP_SECTORS) + GROUP_SECTORS;
+      size_t n = (group_end < end ? group_end : end) - s;
+      if (used)
+        group_free[s / GROUP_SECTORS] -= n;
+      else
+        group_free[s / GROUP_SECTORS] += n;
+    }
+}
+
+/* Counts the free sectors of every group from the free map. */
+static void
+free_map_count_groups (void)
+{
+  size_t size = bitmap_size (free_map);
+  size_t g;
+
+  for (g = 0; g < group_cnt; g++)
+    {
+      size_t start = g * GROUP_SECTORS;
+      size_t cnt = size - start < GROUP_SECTORS ? size - start : GROUP_SECTORS;
+      group_free[g] = cnt - bitmap_count (free_map, start, cnt, true);
+    }
+}
+
+/* Returns the first sector of the first run of CNT free sectors
+   which starts in group G at or after START, or BITMAP_ERROR if
+   there is none.  The run may end past the group.  Updates
+   *BEST and *BEST_CNT to the longest shorter run seen.
+   Each free run is found with two bitmap scans, which skip a
+   whole word of the bitmap at a time. */
+static block_sector_t
+group_scan (size_t g, block_sector_t start, size_t cnt,
+            block_sector_t *best, size_t *best_cnt)
+{
+  size_t size = bitmap_size (free_map);
+  size_t group_end = (g + 1) * GROUP_SECTORS;
+  size_t s = start;
+
+  while (s < group_end && s < size)
+    {
+      size_t first = bitmap_scan (free_map, s, 1, false);
+      if (first == BITMAP_ERROR || first >= group_end)
+        break;
+
+      size_t used = bitmap_scan (free_map, first, 1, true);
+      size_t run = (used == BITMAP_ERROR ? size : used) - first;
+      if (run >= cnt)
+        return first;
+      if (run > *best_cnt)
+        {
+          *best = first;
+          *best_cnt = run;
+        }
+      s = first + run;
+    }
+  return BITMAP_ERROR;
+}
+
+/* Finds a run of CNT free sectors as close after HINT as
+   possible: in the group of HINT first, then in the next groups
+   with enough free sectors, wrapping around the disk.  Stores the
+   number of sectors found in *GOT and returns the first one, or
+   BITMAP_ERROR if there is none.
+   If EXACT is true, the free run index answers in logarithmic
+   time.  Otherwise, settles for the longest shorter run once
+   FREE_MAP_SCAN_GROUPS groups failed to hold CNT sectors, so that
+   allocation on a nearly full disk does not scan all of it.  Must
+   be called with FREE_MAP_LOCK held. */
+static block_sector_t
+free_map_find (size_t cnt, block_sector_t hint, bool exact, size_t *got)
+{
+  block_sector_t best = BITMAP_ERROR;
+  size_t best_cnt = 0;
+  size_t first, i, searched = 0;
+
+  if (hint >= bitmap_size (free_map))
+    hint = 0;
+  first = hint / GROUP_SECTORS;
+
+  /* The first run after HINT, or else after the start of the
+     disk, is the one the groups would be searched for. */
+  if (exact)
+    {
+      block_sector_t sector = bitmap_scan (free_map, hint, cnt, false);
+      if (sector == BITMAP_ERROR && hint != 0)
+        sector = bitmap_scan (free_map, 0, cnt, false);
+      if (sector != BITMAP_ERROR)
+        *got = cnt;
+      return sector;
+    }
+
+  /* The group of HINT is scanned from HINT, then again from its
+     start once every other group was tried. */
+  for (i = 0; i <= group_cnt; i++)
+    {
+      size_t g = (first + i) % group_cnt;
+      block_sector_t start = i == 0 ? hint : g * GROUP_SECTORS;
+      block_sector_t sector;
+
+      if (i == group_cnt && hint % GROUP_SECTORS == 0)
+        break;
+      if (group_free[g] == 0)
+        continue;
+
+      sector = group_scan (g, start, cnt, &best, &best_cnt);
+      if (sector != BITMAP_ERROR)
+        {
+          *got = cnt;
+          return sector;
+        }
+      if (best_cnt > 0 && ++searched >= FREE_MAP_SCAN_GROUPS)
+        break;
+    }
+
+  if (best_cnt == 0)
+    return BITMAP_ERROR;
+  *got = best_cnt;
+  return best;
+}
 
 /* Initializes the free map. */
 void
@@ -17,36 +260,200 @@ free_map_init (void)
     PANIC ("bitmap creation failed--file system device is too large");
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  free_map_dirty = bitmap_create (DIV_ROUND_UP (bitmap_file_size (free_map),
+                                                BLOCK_SECTOR_SIZE));
+  if (free_map_dirty == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+
+  /* Runs of free sectors are found through an index of them. */
+  size_t index_size = bitmap_index_size (bitmap_size (free_map));
+  void *index = malloc (index_size);
+  if (index == NULL)
+    PANIC ("free map index allocation failed");
+  bitmap_index_in_buf (free_map, index, index_size);
+
+  group_cnt = DIV_ROUND_UP (bitmap_size (free_map), GROUP_SECTORS);
+  group_free = malloc (group_cnt * sizeof *group_free);
+  if (group_free == NULL)
+    PANIC ("free map group table allocation failed");
+  free_map_count_groups ();
+  next_fit = 0;
+  next_group = 0;
+
+  lock_init (&free_map_lock);
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
-   the first into *SECTORP.
+   the first into *SECTORP, searching from HINT, or from where the
+   last allocation without a hint ended if HINT is 0.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
-bool
-free_map_allocate (size_t cnt, block_sector_t *sectorp)
+   sectors were available.  The blocks of removed files still
+   waiting for the reclaim thread are released before giving up.
+   The change reaches the free map file at the next
+   free_map_flush(). */
+static bool
+free_map_allocate_from (size_t cnt, block_sector_t hint,
+                        block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  block_sector_t sector;
+  size_t got;
+
+  do
     {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
+      lock_acquire (&free_map_lock);
+      sector = free_map_find (cnt, hint != 0 ? hint : next_fit, true, &got);
+      if (sector != BITMAP_ERROR)
+        {
+          free_map_mark (sector, cnt, true);
+          if (hint == 0)
+            next_fit = sector + cnt;
+        }
+      lock_release (&free_map_lock);
     }
+  while (sector == BITMAP_ERROR && inode_reclaim_wait ());
+
   if (sector != BITMAP_ERROR)
     *sectorp = sector;
   return sector != BITMAP_ERROR;
 }
 
+/* Allocates CNT consecutive sectors from the free map, next-fit
+   from where the last such allocation ended, and stores the first
+   into *SECTORP.  Returns true if successful, false if not enough
+   consecutive sectors were available. */
+bool
+free_map_allocate (size_t cnt, block_sector_t *sectorp)
+{
+  return free_map_allocate_from (cnt, 0, sectorp);
+}
+
+/* Allocates one sector as close after HINT as possible, such as
+   the inode of a file next to its directory, and stores it into
+   *SECTORP.  Returns true if successful, false if the disk is
+   full. */
+bool
+free_map_allocate_near (block_sector_t hint, block_sector_t *sectorp)
+{
+  return free_map_allocate_from (1, hint, sectorp);
+}
+
+/* Allocates one sector for the inode of a new directory and stores
+   it into *SECTORP.  It goes to the group with the most free
+   sectors, the search starting one group further each time, so
+   that directories spread over the disk and the files created in
+   them have room to grow next to them.  Returns true if
+   successful, false if the disk is full. */
+bool
+free_map_allocate_dir (block_sector_t *sectorp)
+{
+  size_t g, i;
+
+  lock_acquire (&free_map_lock);
+  g = next_group % group_cnt;
+  for (i = 1; i < group_cnt; i++)
+    {
+      size_t h = (next_group + i) % group_cnt;
+      if (group_free[h] > group_free[g])
+        g = h;
+    }
+  next_group = g + 1;
+  lock_release (&free_map_lock);
+
+  /* Sector 0 means no hint. */
+  return free_map_allocate_from (1, g == 0 ? 1 : g * GROUP_SECTORS, sectorp);
+}
+
+/* Does the work of free_map_allocate_run() without waiting for
+   the reclaim thread.  Must be called with FREE_MAP_LOCK held. */
+static size_t
+free_map_take_run (size_t cnt, block_sector_t hint, block_sector_t *sectorp)
+{
+  size_t size = bitmap_size (free_map);
+  block_sector_t sector = BITMAP_ERROR;
+  size_t got = 0;
+
+  if (hint != 0)
+    while (got < cnt && hint + got < size
+           && !bitmap_test (free_map, hint + got))
+      got++;
+  if (got > 0)
+    sector = hint;
+  else
+    sector = free_map_find (cnt, hint != 0 ? hint : next_fit, false, &got);
+  if (sector == BITMAP_ERROR)
+    return 0;
+
+  free_map_mark (sector, got, true);
+  if (hint == 0)
+    next_fit = sector + got;
+  *sectorp = sector;
+  return got;
+}
+
+/* Allocates up to CNT consecutive sectors from the free map and
+   stores the first into *SECTORP.  The sectors starting at HINT
+   are taken if they are free, so that a file can grow in place.
+   Otherwise the first run of CNT free sectors after HINT is
+   taken, in its group or the next ones, or the longest shorter
+   run found on the way if there is none.  Without a HINT, the
+   search goes on from where the last one ended.
+   Returns the number of sectors allocated, which is 0 if the
+   disk is full.
+   Like free_map_allocate(), waits for the reclaim thread before
+   reporting the disk full. */
+size_t
+free_map_allocate_run (size_t cnt, block_sector_t hint,
+                       block_sector_t *sectorp)
+{
+  size_t got;
+
+  do
+    {
+      lock_acquire (&free_map_lock);
+      got = free_map_take_run (cnt, hint, sectorp);
+      lock_release (&free_map_lock);
+    }
+  while (got == 0 && inode_reclaim_wait ());
+
+  return got;
+}
+
 /* Makes CNT sectors starting at SECTOR available for use. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
-  ASSERT (bitmap_all (free_map, sector, cnt));
-  bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  lock_acquire (&free_map_lock);
+  free_map_mark (sector, cnt, false);
+  lock_release (&free_map_lock);
+}
+
+/* Makes the sectors of the CNT extents in EXTENTS available for
+   use. */
+void
+free_map_release_extents (const struct inode_extent *extents, size_t cnt)
+{
+  size_t i;
+
+  lock_acquire (&free_map_lock);
+  for (i = 0; i < cnt; i++)
+    free_map_mark (extents[i].start, extents[i].length, false);
+  lock_release (&free_map_lock);
+}
+
+/* Writes the changes made to the free map since the last call to
+   the free map file.  Called before an inode is written, so that
+   the sectors it points to are marked used on the disk first, and
+   periodically by the inode flusher. */
+void
+free_map_flush (void)
+{
+  if (free_map_file == NULL)
+    return;
+
+  lock_acquire (&free_map_lock);
+  if (!free_map_store (false))
+    PANIC ("can't write free map");
+  lock_release (&free_map_lock);
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -56,15 +463,18 @@ free_map_open (void)
   free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
   if (free_map_file == NULL)
     PANIC ("can't open free map");
-  if (!bitmap_read (free_map, free_map_file))
+  if (!free_map_load ())
     PANIC ("can't read free map");
+  free_map_count_groups ();
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
 free_map_close (void) 
 {
+  free_map_flush ();
   file_close (free_map_file);
+  free_map_file = NULL;
 }
 
 /* Creates a new free map file on disk and writes the free map to
@@ -81,7 +491,7 @@ free_map_create (void)
   if (free_map_file == NULL)
     PANIC ("can't open free map");
   /*printf ("here\n");*/
-  if (!bitmap_write (free_map, free_map_file))
+  if (!free_map_store (true))
     PANIC ("can't write free map");
   /*printf ("here2\n");*/
 }
@@ -5,6 +5,8 @@
 #include <stddef.h>
 #include "devices/block.h"
 
+struct inode_extent;
+
 void free_map_init (void);
 void free_map_read (void);
 void free_map_create (void);
@@ -12,6 +14,11 @@ void free_map_open (void);
 void free_map_close (void);
 
 bool free_map_allocate (size_t, block_sector_t *);
+bool free_map_allocate_near (block_sector_t hint, block_sector_t *);
+bool free_map_allocate_dir (block_sector_t *);
+size_t free_map_allocate_run (size_t, block_sector_t hint, block_sector_t *);
 void free_map_release (block_sector_t, size_t);
+void free_map_release_extents (const struct inode_extent *, size_t);
+void free_map_flush (void);
 
 #endif /* filesys/free-map.h */
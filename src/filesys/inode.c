@@ -1,5 +1,6 @@
 #include "filesys/inode.h"
 #include <list.h>
+#include <hash.h>
 #include <debug.h>
 #include <round.h>
 #include <string.h>
@@ -9,21 +10,39 @@
 
 #include "filesys/cache.h"
 #include "threads/vaddr.h"
+#include "threads/thread.h"
+#include "threads/palloc.h"
+#include "devices/timer.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
-#define MAXFILESIZE (1 << 23)
+/* Number of extents held by a spill block. */
+#define SPILL_EXTENTS 63
 
-#define LEVEL1SHIFT 16
-#define LEVEL1MASK BITMASK(16, 7)
-#define LEVEL1SIZE 128
+/* Block holding the extents of a file past the INODE_EXTENTS
+   first ones.  Spill blocks form a chain.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct inode_spill
+  {
+    block_sector_t next;                /* Next spill block, or 0. */
+    uint32_t unused;                    /* Not used. */
+    struct inode_extent extents[SPILL_EXTENTS]; /* Extents, in file order. */
+  };
+
+// Read-ahead window bounds in sectors
+#define READAHEAD_MIN 2
+#define READAHEAD_MAX 16
+
+// Most sectors moved by one request of a direct transfer, and the pages of its bounce buffer
+#define INODE_DIRECT_RUN 32
+#define INODE_DIRECT_PAGES (INODE_DIRECT_RUN * BLOCK_SECTOR_SIZE / PGSIZE)
 
-#define LEVEL2SHIFT 9
-#define LEVEL2MASK BITMASK(9, 7)
-#define LEVEL2SIZE 128
+// Smallest transfer in bytes which bypasses the buffer cache, or 0 to never bypass it
+int inode_direct_min = INODE_DIRECT_MIN ;
 
-#define SECTORMASK BITMASK(0,9)
+/* Most extents returned to the free map with one write of it. */
+#define RELEASE_BATCH 32
 
 // Block of all zeroes which is used to write 0s to a file block
 char *zeros ;
@@ -36,86 +55,734 @@ bytes_to_sectors (off_t size)
   return DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE);
 }
 
+/* Finds the extent of INODE holding sector FIRST of the file
+   and stores it in *M, with M->first set to the first sector of
+   the file it holds, and its index in *IP.  Returns false if
+   there is none.
+   The extents in the inode are searched first, then the spill
+   blocks, each of which is read in place in the buffer cache. */
+static bool
+extent_find (const struct inode *inode, uint32_t first, struct inode_map *m,
+             uint32_t *ip)
+{
+  const struct inode_disk *d = &inode->data;
+  block_sector_t sector;
+  uint32_t pos = 0, i, j;
+  bool found = false;
+
+  for (i = 0; i < d->extent_cnt && i < INODE_EXTENTS; i++)
+    {
+      if (first < pos + d->extents[i].length)
+        {
+          m->first = pos;
+          m->extent = d->extents[i];
+          *ip = i;
+          return true;
+        }
+      pos += d->extents[i].length;
+    }
+
+  for (sector = d->spill; sector != 0 && !found; )
+    {
+      const struct inode_spill *spill = cache_get (sector, CACHE_SHARED);
+      block_sector_t next = spill->next;
+
+      for (j = 0; j < SPILL_EXTENTS && i < d->extent_cnt; i++, j++)
+        {
+          if (first < pos + spill->extents[j].length)
+            {
+              m->first = pos;
+              m->extent = spill->extents[j];
+              *ip = i;
+              found = true;
+              break;
+            }
+          pos += spill->extents[j].length;
+        }
+
+      cache_put (sector, false);
+      sector = next;
+    }
+
+  return found;
+}
+
 /* Returns the block device sector that contains byte offset POS
    within INODE.
    Returns -1 if INODE does not contain data for a byte at offset
-   POS. */
+   POS, and 0 if POS lies in a hole, which reads as zeros.
+   Recently used extents are remembered in the mapping cache of
+   INODE, so that accesses to a hot file translate offsets
+   without walking the extents or touching the buffer cache. */
 static block_sector_t
-byte_to_sector (struct inode *inode, off_t pos) 
+byte_to_sector (struct inode *inode, off_t pos)
+{
+  struct inode_map m;
+  uint32_t first, idx;
+  int i;
+
+  ASSERT (inode != NULL);
+  if (pos < 0 || (uint32_t) (pos / BLOCK_SECTOR_SIZE) >= inode->data.sector_cnt)
+    return -1;
+  first = pos / BLOCK_SECTOR_SIZE;
+
+  lock_acquire (&inode->map_lock);
+  for (i = 0; i < INODE_MAP_SIZE; i++)
+    {
+      const struct inode_map *e = &inode->map[i];
+      if (first >= e->first && first < e->first + e->extent.length)
+        {
+          block_sector_t sector = e->extent.start == 0
+                                  ? 0 : e->extent.start + (first - e->first);
+          lock_release (&inode->map_lock);
+          return sector;
+        }
+    }
+
+  /* MAP_LOCK is held during the search, so that the extents are
+     not moved meanwhile by extent_replace(). */
+  if (!extent_find (inode, first, &m, &idx))
+    {
+      lock_release (&inode->map_lock);
+      return -1;
+    }
+
+  /* Replace the entries in turn.  The last extent may have grown
+     since an entry was made for it, which only makes the entry
+     cover less than it could. */
+  inode->map[inode->map_next] = m;
+  inode->map_next = (inode->map_next + 1) % INODE_MAP_SIZE;
+  lock_release (&inode->map_lock);
+
+  return m.extent.start == 0 ? 0 : m.extent.start + (first - m.first);
+}
+
+/* Forgets the extents remembered by the mapping cache of INODE.
+   Must be called whenever extents are replaced or sectors are
+   taken away from INODE. */
+static void
+inode_map_invalidate (struct inode *inode)
+{
+  lock_acquire (&inode->map_lock);
+  memset (inode->map, 0, sizeof inode->map);
+  inode->map_next = 0;
+  lock_release (&inode->map_lock);
+}
+
+/* Returns the slot of extent I of INODE.  If the slot lives in a
+   spill block, the block is held with exclusive access and its
+   sector is stored in *SPILLP: the caller must release it with
+   cache_put().  Otherwise *SPILLP is set to 0.
+   Missing spill blocks are allocated.  Returns a null pointer if
+   the disk is full. */
+static struct inode_extent *
+extent_slot (struct inode *inode, uint32_t i, block_sector_t *spillp)
+{
+  block_sector_t *link = &inode->data.spill;
+  block_sector_t prev = 0;
+  bool linked = false;
+
+  *spillp = 0;
+  if (i < INODE_EXTENTS)
+    return &inode->data.extents[i];
+  i -= INODE_EXTENTS;
+
+  while (1)
+    {
+      block_sector_t sector = *link;
+
+      if (sector == 0)
+        {
+          if (!free_map_allocate_near (inode->sector, &sector))
+            {
+              if (prev != 0)
+                cache_put (prev, false);
+              return NULL;
+            }
+          write_cache (sector, zeros, 0, BLOCK_SECTOR_SIZE, false);
+          *link = sector;
+          linked = true;
+        }
+      if (prev != 0)
+        cache_put (prev, linked);
+
+      struct inode_spill *spill = cache_get (sector, CACHE_EXCLUSIVE);
+      if (i < SPILL_EXTENTS)
+        {
+          *spillp = sector;
+          return &spill->extents[i];
+        }
+
+      i -= SPILL_EXTENTS;
+      prev = sector;
+      link = &spill->next;
+      linked = false;
+    }
+}
+
+/* Returns the sector right after the last extent of INODE, or 0
+   if INODE has no data or ends with a hole. */
+static block_sector_t
+extent_end (struct inode *inode)
+{
+  struct inode_extent *e;
+  block_sector_t spill, end;
+
+  if (inode->data.extent_cnt == 0)
+    return 0;
+
+  e = extent_slot (inode, inode->data.extent_cnt - 1, &spill);
+  end = e->start == 0 ? 0 : e->start + e->length;
+  if (spill != 0)
+    cache_put (spill, false);
+  return end;
+}
+
+/* Appends the CNT sectors starting at START to the data of
+   INODE, growing its last extent when they follow it on the
+   disk.  A START of 0 appends a hole of CNT sectors.
+   Returns false if a spill block could not be allocated.
+   The caller writes the inode back. */
+static bool
+extent_append (struct inode *inode, block_sector_t start, uint32_t cnt)
+{
+  struct inode_disk *d = &inode->data;
+  struct inode_extent *e;
+  block_sector_t spill;
+
+  if (d->extent_cnt > 0)
+    {
+      e = extent_slot (inode, d->extent_cnt - 1, &spill);
+      if (start == 0 ? e->start == 0
+                     : e->start != 0 && e->start + e->length == start)
+        {
+          e->length += cnt;
+          if (spill != 0)
+            cache_put (spill, true);
+          return true;
+        }
+      if (spill != 0)
+        cache_put (spill, false);
+    }
+
+  e = extent_slot (inode, d->extent_cnt, &spill);
+  if (e == NULL)
+    return false;
+  e->start = start;
+  e->length = cnt;
+  if (spill != 0)
+    cache_put (spill, true);
+  d->extent_cnt++;
+  return true;
+}
+
+/* Allocates sectors to INODE until it holds LENGTH bytes, in
+   runs as long as the free map has.  The sectors lying entirely
+   before KEEP_START which INODE does not hold yet are left as a
+   hole.  New sectors are zeroed, except the ones lying entirely
+   within [KEEP_START, KEEP_END), which the caller is about to
+   overwrite.
+   Returns false if the disk is full or LENGTH is too large.  The
+   sectors allocated so far are kept.  The caller writes the
+   inode back. */
+static bool
+inode_grow (struct inode *inode, off_t length, off_t keep_start,
+            off_t keep_end)
+{
+  struct inode_disk *d = &inode->data;
+  size_t want = bytes_to_sectors (length);
+  bool success = true;
+
+  if (length > MAXFILESIZE)
+    {
+      want = bytes_to_sectors (MAXFILESIZE);
+      success = false;
+    }
+
+  /* Skipped sectors cost neither space nor I/O. */
+  size_t hole_end = keep_start / BLOCK_SECTOR_SIZE;
+  if (hole_end > want)
+    hole_end = want;
+  if (d->sector_cnt < hole_end)
+    {
+      if (!extent_append (inode, 0, hole_end - d->sector_cnt))
+        return false;
+      d->sector_cnt = hole_end;
+    }
+
+  while (d->sector_cnt < want)
+    {
+      block_sector_t start;
+      size_t cnt, i;
+
+      /* Grow in place, or else next to the inode. */
+      block_sector_t hint = extent_end (inode);
+      cnt = free_map_allocate_run (want - d->sector_cnt,
+                                   hint != 0 ? hint : inode->sector, &start);
+      if (cnt == 0)
+        return false;
+      if (!extent_append (inode, start, cnt))
+        {
+          free_map_release (start, cnt);
+          return false;
+        }
+
+      for (i = 0; i < cnt; i++)
+        {
+          off_t ofs = (off_t) (d->sector_cnt + i) * BLOCK_SECTOR_SIZE;
+          if (ofs < keep_start || ofs + BLOCK_SECTOR_SIZE > keep_end)
+            write_cache (start + i, zeros, 0, BLOCK_SECTOR_SIZE, false);
+        }
+      d->sector_cnt += cnt;
+    }
+
+  return success;
+}
+
+/* Hands the sectors reserved by inode_reserve() which a write of
+   [OFFSET, END) reaches over to the data of INODE.  The ones the
+   write does not cover entirely are zeroed first, so that the
+   bytes of the file it skips read as zeros.  Must be called with
+   the lock of INODE held.  The caller writes the inode back. */
+static void
+inode_claim (struct inode *inode, off_t offset, off_t end)
 {
-	bool success ;
+  struct inode_disk *d = &inode->data;
+  uint32_t first = d->sector_cnt - d->reserved_cnt;
+  uint32_t last = bytes_to_sectors (end);
+  uint32_t i;
 
-	ASSERT (inode != NULL);
-	if ( pos > MAXFILESIZE )
-		return -1 ;
+  if (d->reserved_cnt == 0 || last <= first)
+    return;
+  if (last > d->sector_cnt)
+    last = d->sector_cnt;
 
-	if ( inode->sector == 0 )
-		return inode->data.start + pos / BLOCK_SECTOR_SIZE ;
+  for (i = first; i < last; i++)
+    {
+      off_t ofs = (off_t) i * BLOCK_SECTOR_SIZE;
+      if (ofs < offset || ofs + BLOCK_SECTOR_SIZE > end)
+        write_cache (byte_to_sector (inode, ofs), zeros, 0, BLOCK_SECTOR_SIZE,
+                     false);
+    }
+  d->reserved_cnt = d->sector_cnt - last;
+}
 
-	/*printf ( "inside byte to sector with pos %u\n", pos);*/
-	int level1pos = ((pos & LEVEL1MASK) >> LEVEL1SHIFT) * sizeof(block_sector_t) ;
-	block_sector_t level1 ;
+/* Gives the sectors of INODE past its first SECTOR_CNT back to
+   the free map, shortening or dropping its last extents.  The
+   spill blocks stay in the chain, to be used again.  Must be
+   called with the lock of INODE held.  The caller writes the
+   inode back. */
+static void
+extent_truncate (struct inode *inode, uint32_t sector_cnt)
+{
+  struct inode_disk *d = &inode->data;
 
-	/*printf ( "   level1pos: %d\n", level1pos) ;*/
-	/*printf ( "   LEVEL1MASK: %d and LEVEL2MASK: %d\n", LEVEL1MASK, LEVEL2MASK ) ;*/
-	read_cache ( inode->data.start, &level1, level1pos, sizeof(block_sector_t) ) ;
+  lock_acquire (&inode->map_lock);
+  while (d->sector_cnt > sector_cnt)
+    {
+      block_sector_t spill;
+      struct inode_extent *e = extent_slot (inode, d->extent_cnt - 1, &spill);
+      uint32_t cnt = d->sector_cnt - sector_cnt;
+
+      if (cnt > e->length)
+        cnt = e->length;
+      if (e->start != 0)
+        free_map_release (e->start + e->length - cnt, cnt);
+      e->length -= cnt;
+      if (e->length == 0)
+        d->extent_cnt--;
+      d->sector_cnt -= cnt;
+      if (spill != 0)
+        cache_put (spill, true);
+    }
 
-	// If second level not present, create a second level entry
-	if ( level1 == 0 )
-	{
-		success = free_map_allocate(1, &level1 ) ;
-		if ( success == false )
-		{
-			/*printf ( "failed1\n\n") ;*/
-			return -1 ;
-		}
+  memset (inode->map, 0, sizeof inode->map);
+  inode->map_next = 0;
+  lock_release (&inode->map_lock);
+}
 
-		write_cache ( level1, zeros, 0, BLOCK_SECTOR_SIZE, false ) ;
+/* Replaces extent I of INODE by the N extents of PIECES, moving
+   the extents after it.  Returns false, with nothing changed, if
+   a spill block could not be allocated.  Must be called with the
+   lock of INODE held.  The caller writes the inode back. */
+static bool
+extent_replace (struct inode *inode, uint32_t i,
+                const struct inode_extent *pieces, int n)
+{
+  struct inode_disk *d = &inode->data;
+  struct inode_extent *e, moved;
+  block_sector_t spill;
+  uint32_t j;
+  int k;
+
+  /* Make sure the last slot needed exists before moving anything. */
+  e = extent_slot (inode, d->extent_cnt + n - 2, &spill);
+  if (e == NULL)
+    return false;
+  if (spill != 0)
+    cache_put (spill, false);
+
+  /* Readers search the extents with MAP_LOCK held.  Each extent is
+     copied out before the next slot is taken, since two slots may
+     share a spill block. */
+  lock_acquire (&inode->map_lock);
+  for (j = d->extent_cnt - 1; n > 1 && j > i; j--)
+    {
+      e = extent_slot (inode, j, &spill);
+      moved = *e;
+      if (spill != 0)
+        cache_put (spill, false);
+
+      e = extent_slot (inode, j + n - 1, &spill);
+      *e = moved;
+      if (spill != 0)
+        cache_put (spill, true);
+    }
+  for (k = 0; k < n; k++)
+    {
+      e = extent_slot (inode, i + k, &spill);
+      *e = pieces[k];
+      if (spill != 0)
+        cache_put (spill, true);
+    }
+  d->extent_cnt += n - 1;
 
-		write_cache ( inode->data.start, &level1, level1pos, sizeof(block_sector_t), true) ;
-	}
+  memset (inode->map, 0, sizeof inode->map);
+  inode->map_next = 0;
+  lock_release (&inode->map_lock);
 
-	int level2pos = ((pos & LEVEL2MASK) >> LEVEL2SHIFT) * sizeof(block_sector_t) ;
-	block_sector_t level2 ;
+  return true;
+}
 
-	read_cache ( level1, &level2, level2pos, sizeof(block_sector_t) ) ;
+/* Allocates sectors for the hole of INODE holding byte offset
+   POS, covering as much of [POS, END) as the hole and the free
+   map allow.  The new sectors are zeroed in the buffer cache, so
+   they are never read from the disk.
+   Returns false if the disk is full. */
+static bool
+inode_fill_hole (struct inode *inode, off_t pos, off_t end)
+{
+  uint32_t first = pos / BLOCK_SECTOR_SIZE;
+  struct inode_map m;
+  bool success = true;
+  uint32_t idx;
 
-	// If second level not present, create a second level entry
-	if ( level2 == 0 )
-	{
-		success = free_map_allocate(1, &level2 ) ;
-		if ( success == false )
-		{
-			/*printf ( "failed2\n\n") ;*/
-			return -1 ;
-		}
+  lock_acquire (&inode->lock);
 
-		write_cache ( level2, zeros, 0, BLOCK_SECTOR_SIZE, false ) ;
+  /* Someone may have filled it meanwhile. */
+  lock_acquire (&inode->map_lock);
+  bool hole = extent_find (inode, first, &m, &idx) && m.extent.start == 0;
+  lock_release (&inode->map_lock);
 
-		write_cache ( level1, &level2, level2pos, sizeof(block_sector_t), true) ;
-	}
+  if (hole)
+    {
+      uint32_t hole_end = m.first + m.extent.length;
+      uint32_t last = bytes_to_sectors (end);
+      struct inode_extent pieces[3];
+      block_sector_t start, hint = 0;
+      size_t cnt, i;
+      int n = 0;
+
+      if (last > hole_end)
+        last = hole_end;
+
+      /* Follow the sector before, if it is not in a hole too. */
+      if (first > 0)
+        {
+          block_sector_t prev = byte_to_sector (inode, (off_t) (first - 1)
+                                                       * BLOCK_SECTOR_SIZE);
+          if ((signed) prev != -1 && prev != 0)
+            hint = prev + 1;
+        }
 
-	/*printf ( "  Level1: %d Level2: %d\n", level1, level2 ) ;*/
-	/*if ( pos > inode->data.length )*/
-	/*{*/
-		/*printf ( "pos greater than length\n") ;*/
-		/*inode->data.length = pos ;*/
+      cnt = free_map_allocate_run (last - first,
+                                   hint != 0 ? hint : inode->sector, &start);
+      if (cnt == 0)
+        success = false;
+      else
+        {
+          for (i = 0; i < cnt; i++)
+            write_cache (start + i, zeros, 0, BLOCK_SECTOR_SIZE, false);
+
+          if (first > m.first)
+            {
+              pieces[n].start = 0;
+              pieces[n++].length = first - m.first;
+            }
+          pieces[n].start = start;
+          pieces[n++].length = cnt;
+          if (first + cnt < hole_end)
+            {
+              pieces[n].start = 0;
+              pieces[n++].length = hole_end - first - cnt;
+            }
+
+          if (extent_replace (inode, idx, pieces, n))
+            inode->dirty = true;
+          else
+            {
+              free_map_release (start, cnt);
+              success = false;
+            }
+        }
+    }
 
-		/*write_cache ( inode->sector, &inode->data, 0, BLOCK_SECTOR_SIZE, false ) ;*/
-	/*}*/
+  lock_release (&inode->lock);
+  return success;
+}
 
-	return level2 ;
+/* Adds the LENGTH sectors from START to the BATCH of *CNT
+   extents to release, releasing the batch first if it is full.
+   Holes are skipped. */
+static void
+release_add (struct inode_extent *batch, size_t *cnt,
+             block_sector_t start, uint32_t length)
+{
+  if (start == 0)
+    return;
+  if (*cnt == RELEASE_BATCH)
+    {
+      free_map_release_extents (batch, *cnt);
+      *cnt = 0;
+    }
+  batch[*cnt].start = start;
+  batch[(*cnt)++].length = length;
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Returns the data sectors and the spill blocks of INODE to the
+   free map, RELEASE_BATCH extents at a time. */
+static void
+inode_release_blocks (struct inode *inode)
+{
+  const struct inode_disk *d = &inode->data;
+  struct inode_extent batch[RELEASE_BATCH];
+  size_t cnt = 0;
+  block_sector_t sector;
+  uint32_t i, j;
+
+  inode_map_invalidate (inode);
+  if (d->isinline)
+    return;
+
+  for (i = 0; i < d->extent_cnt && i < INODE_EXTENTS; i++)
+    release_add (batch, &cnt, d->extents[i].start, d->extents[i].length);
+
+  for (sector = d->spill; sector != 0; )
+    {
+      const struct inode_spill *spill = cache_get (sector, CACHE_SHARED);
+      block_sector_t next = spill->next;
+
+      for (j = 0; j < SPILL_EXTENTS && i < d->extent_cnt; i++, j++)
+        release_add (batch, &cnt, spill->extents[j].start,
+                     spill->extents[j].length);
+
+      cache_put (sector, false);
+      release_add (batch, &cnt, sector, 1);
+      sector = next;
+    }
+
+  if (cnt > 0)
+    free_map_release_extents (batch, cnt);
+}
+
+/* Moves the data of INODE out of the inode into sectors, if it
+   is still inline.  Returns false if the disk is full, in which
+   case the data stays inline. */
+static bool
+inode_promote (struct inode *inode)
+{
+  struct inode_disk *d = &inode->data;
+  uint8_t bounce[INODE_INLINE_SIZE];
+  bool success = true;
+  off_t ofs;
+
+  lock_acquire (&inode->lock);
+  if (d->isinline)
+    {
+      memcpy (bounce, d->inline_data, sizeof bounce);
+      memset (d->extents, 0, sizeof d->extents);
+      d->isinline = 0;
+      d->sector_cnt = 0;
+      d->extent_cnt = 0;
+      d->spill = 0;
+
+      /* The inode on the disk still holds the data inline.  Every
+         sector must be written before it stops doing so. */
+      inode->disk_length = 0;
+
+      /* The sectors filled from BOUNCE need no zeroing. */
+      if (inode_grow (inode, d->length, 0, d->length))
+        for (ofs = 0; ofs < d->length; ofs += BLOCK_SECTOR_SIZE)
+          {
+            int chunk = d->length - ofs < BLOCK_SECTOR_SIZE
+                        ? d->length - ofs : BLOCK_SECTOR_SIZE;
+            write_cache (byte_to_sector (inode, ofs), bounce + ofs, 0, chunk,
+                         false);
+          }
+      else
+        {
+          inode_release_blocks (inode);
+          memcpy (d->inline_data, bounce, sizeof bounce);
+          d->isinline = 1;
+          d->sector_cnt = 0;
+          d->extent_cnt = 0;
+          d->spill = 0;
+          success = false;
+        }
+
+      inode->dirty = true;
+    }
+  lock_release (&inode->lock);
+
+  return success;
+}
+
+/* Writes back the dirty sectors of INODE holding the bytes from
+   START to END, one run of sectors consecutive on the disk at a
+   time. */
+static void
+inode_sync_data (struct inode *inode, off_t start, off_t end)
+{
+  block_sector_t run = 0;
+  size_t cnt = 0;
+  off_t pos;
+
+  for (pos = ROUND_DOWN (start, BLOCK_SECTOR_SIZE); pos < end;
+       pos += BLOCK_SECTOR_SIZE)
+    {
+      block_sector_t sector = byte_to_sector (inode, pos);
+      if (sector == (block_sector_t) -1)
+        break;
+      if (cnt > 0 && sector == run + cnt)
+        {
+          cnt++;
+          continue;
+        }
+      if (cnt > 0)
+        cache_sync_range (run, cnt);
+      run = sector;
+      cnt = sector != 0;
+    }
+  if (cnt > 0)
+    cache_sync_range (run, cnt);
+}
+
+/* Writes INODE back to its sector if it changed since it was
+   last written.  The data up to the new length is written to the
+   disk first, so that the length on the disk never covers sectors
+   which still hold stale data. */
+static void
+inode_writeback (struct inode *inode)
+{
+  lock_acquire (&inode->lock);
+  if (inode->dirty)
+    {
+      if (!inode->data.isinline)
+        inode_sync_data (inode, inode->disk_length, inode->data.length);
+
+      /* So is the free map, which marks the new sectors used. */
+      free_map_flush ();
+      write_cache (inode->sector, &inode->data, 0, BLOCK_SECTOR_SIZE, false);
+      inode->disk_length = inode->data.length;
+      inode->dirty = false;
+    }
+  lock_release (&inode->lock);
+}
+
+/* Open inodes, hashed by sector, so that opening a single inode
+   twice returns the same `struct inode'.  OPEN_LOCK protects the
+   table and the OPEN_CNT of every inode in it. */
+static struct hash open_inodes;
+static struct lock open_lock;
+
+/* Inodes with no opener left, kept in OPEN_INODES so that the
+   next inode_open() of their sector revives them without reading
+   the disk.  Least recently closed first.  Protected by
+   OPEN_LOCK. */
+static struct list closed_inodes;
+static int closed_cnt;
+
+/* Serializes the passes of inode_sync().  Protects INODE_CLOSED,
+   which stops the periodic passes at shutdown. */
+static struct lock sync_lock;
+static bool inode_closed;
+
+/* Removed inodes closed for the last time, whose blocks wait for
+   the reclaim thread, linked by CLOSED_ELEM.  RECLAIM_CNT counts
+   them and the inode being reclaimed.  Both are protected by
+   RECLAIM_LOCK. */
+static struct list reclaim_inodes;
+static int reclaim_cnt;
+static struct lock reclaim_lock;
+static struct condition reclaim_queued;  /* Signalled when an inode is queued. */
+static struct condition reclaim_idle;    /* Signalled when RECLAIM_CNT drops to 0. */
+
+static void inode_flusher (void *aux UNUSED);
+static void inode_reclaimer (void *aux UNUSED);
+
+/* Returns a hash value for the open inode E. */
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct inode *inode = hash_entry (e, struct inode, elem);
+  return hash_int (inode->sector);
+}
+
+/* Returns true if open inode A precedes open inode B. */
+static bool
+inode_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  return hash_entry (a, struct inode, elem)->sector
+         < hash_entry (b, struct inode, elem)->sector;
+}
+
+/* Returns the open inode for SECTOR with one more opener, or a
+   null pointer if it is not open.  Must be called with OPEN_LOCK
+   held. */
+static struct inode *
+inode_find (block_sector_t sector)
+{
+  struct inode key;
+  struct hash_elem *e;
+
+  key.sector = sector;
+  e = hash_find (&open_inodes, &key.elem);
+  if (e == NULL)
+    return NULL;
+
+  struct inode *inode = hash_entry (e, struct inode, elem);
+  if (inode->open_cnt++ == 0)
+    {
+      list_remove (&inode->closed_elem);
+      closed_cnt--;
+    }
+  return inode;
+}
 
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
-  list_init (&open_inodes);
+  if (!hash_init (&open_inodes, inode_hash, inode_less, NULL))
+    PANIC ("inode_init: Failed to allocate the open inode table");
+  lock_init (&open_lock);
+  list_init (&closed_inodes);
+  closed_cnt = 0;
+  lock_init (&sync_lock);
+  inode_closed = false;
+  list_init (&reclaim_inodes);
+  reclaim_cnt = 0;
+  lock_init (&reclaim_lock);
+  cond_init (&reclaim_queued);
+  cond_init (&reclaim_idle);
+
+  if (thread_create ("inode_flusher", PRI_DEFAULT, inode_flusher, NULL)
+      == TID_ERROR)
+    PANIC ("inode_init: Failed to create the inode flusher thread");
+  if (thread_create ("inode_reclaim", PRI_DEFAULT, inode_reclaimer, NULL)
+      == TID_ERROR)
+    PANIC ("inode_init: Failed to create the inode reclaim thread");
 
   zeros = (char*)malloc(BLOCK_SECTOR_SIZE) ;
   memset(zeros, 0, BLOCK_SECTOR_SIZE) ;
@@ -138,30 +805,38 @@ inode_create (block_sector_t sector, off_t length, bool isdir)
   /* If this assertion fails, the inode structure is not exactly
      one sector in size, and you should fix that. */
   ASSERT (sizeof *disk_inode == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof (struct inode_spill) == BLOCK_SECTOR_SIZE);
 
-  disk_inode = calloc (1, sizeof *disk_inode);
-  if (disk_inode != NULL)
+  /* Small files keep their data inline in the inode.  Larger ones
+     are allocated up front, in as few extents as the free map
+     allows.  The free map is accessed sector by sector in the
+     buffer cache, so it is never inline. */
+  struct inode *inode = calloc (1, sizeof *inode);
+  if (inode != NULL)
     {
-      /*size_t sectors = bytes_to_sectors (length);*/
+      disk_inode = &inode->data;
       disk_inode->length = length;
       disk_inode->magic = INODE_MAGIC;
 	  disk_inode->isdir = isdir ;
-      if (free_map_allocate (1, &disk_inode->start)) 
+      inode->sector = sector;
+      lock_init (&inode->lock);
+      lock_init (&inode->map_lock);
+      disk_inode->isinline = length <= (off_t) INODE_INLINE_SIZE
+                             && sector != FREE_MAP_SECTOR;
+      if (disk_inode->isinline || inode_grow (inode, length, 0, 0))
         {
+          /* The zeroed data reaches the disk before the inode which
+             points to it, like in inode_writeback(). */
+          if (!disk_inode->isinline)
+            inode_sync_data (inode, 0, length);
           /*block_write (fs_device, sector, disk_inode);*/
+          free_map_flush ();
 		  write_cache ( sector, disk_inode, 0, BLOCK_SECTOR_SIZE, false ) ;
-
-		  write_cache ( disk_inode->start, zeros, 0, BLOCK_SECTOR_SIZE, false ) ;
-          /*if (sectors > 0) */
-            /*{*/
-              /*size_t i;*/
-              
-              /*for (i = 0; i < sectors; i++) */
-                /*block_write (fs_device, disk_inode->start + i, zeros);*/
-            /*}*/
           success = true; 
         } 
-      free (disk_inode);
+      else
+        inode_release_blocks (inode);
+      free (inode);
     }
   /*printf ( "After inode create\n");*/
   return success;
@@ -174,34 +849,51 @@ struct inode *
 inode_open (block_sector_t sector)
 {
 	/*printf ( "inside inode open\n");*/
-  struct list_elem *e;
-  struct inode *inode;
+  struct inode *inode, *open;
 
   /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e)) 
-    {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector) 
-        {
-          inode_reopen (inode);
-          return inode; 
-        }
-    }
+  lock_acquire (&open_lock);
+  inode = inode_find (sector);
+  lock_release (&open_lock);
+  if (inode != NULL)
+    return inode;
 
-  /* Allocate memory. */
+  /* Allocate memory, taking it back from the closed inodes if
+     the heap is exhausted. */
   inode = malloc (sizeof *inode);
+  if (inode == NULL && inode_shrink ())
+    inode = malloc (sizeof *inode);
   if (inode == NULL)
     return NULL;
 
   /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
   inode->sector = sector;
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
+  inode->dirty = false;
+  lock_init (&inode->lock);
+  lock_init (&inode->map_lock);
+  memset (inode->map, 0, sizeof inode->map);
+  inode->map_next = 0;
+  inode->dir_index = NULL;
   /*block_read (fs_device, inode->sector, &inode->data);*/
   read_cache(inode->sector, &inode->data, 0, BLOCK_SECTOR_SIZE ) ;
+  inode->disk_length = inode->data.length;
+
+  /* The inode is only published once it is read.  Someone may
+     have opened it meanwhile. */
+  lock_acquire (&open_lock);
+  open = inode_find (sector);
+  if (open == NULL)
+    hash_insert (&open_inodes, &inode->elem);
+  lock_release (&open_lock);
+
+  if (open != NULL)
+    {
+      free (inode);
+      return open;
+    }
   /*printf ( "End loop inode: \n");*/
   return inode;
 }
@@ -211,7 +903,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&open_lock);
+      inode->open_cnt++;
+      lock_release (&open_lock);
+    }
   return inode;
 }
 
@@ -224,7 +920,8 @@ inode_get_inumber (const struct inode *inode)
 
 /* Closes INODE and writes it to disk.
    If this was the last reference to INODE, frees its memory.
-   If INODE was also a removed inode, frees its blocks. */
+   If INODE was also a removed inode, hands it to the reclaim
+   thread, which frees its blocks and then its memory. */
 void
 inode_close (struct inode *inode) 
 {
@@ -232,52 +929,206 @@ inode_close (struct inode *inode)
   if (inode == NULL)
     return;
 
-  /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  /* Every opener writes back what changed before letting go, so
+     the inodes left with no opener are clean. */
+  inode_writeback (inode);
+
+  /* Release resources if this was the last opener.  An inode
+     which is not removed is only freed once it is the least
+     recently closed of too many. */
+  struct inode *victim = NULL, *index = NULL;
+  bool last;
+
+  lock_acquire (&open_lock);
+  last = --inode->open_cnt == 0;
+  if (last)
+    {
+      /* The index of a directory is kept open as long as it is. */
+      index = inode->dir_index;
+      inode->dir_index = NULL;
+    }
+  if (last && inode->removed)
+    {
+      hash_delete (&open_inodes, &inode->elem);
+      victim = inode;
+    }
+  else if (last)
+    {
+      list_push_back (&closed_inodes, &inode->closed_elem);
+      if (++closed_cnt > INODE_CLOSED_MAX)
+        {
+          victim = list_entry (list_pop_front (&closed_inodes),
+                               struct inode, closed_elem);
+          hash_delete (&open_inodes, &victim->elem);
+          closed_cnt--;
+        }
+    }
+  lock_release (&open_lock);
+
+  inode_close (index);
+
+  if (victim != NULL)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
- 
-      /* Deallocate blocks if removed. */
+      inode = victim;
+
+      /* Deallocate blocks if removed.  The closer does not wait
+         for it: a large file takes many writes of the free map. */
       if (inode->removed) 
         {
 			/*printf ( "REmoveing inside inode\n") ;*/
-		  int i, j ;
-		  char level1arr[BLOCK_SECTOR_SIZE] ;
-		  read_cache( inode->data.start, level1arr, 0, BLOCK_SECTOR_SIZE ) ;
+          lock_acquire (&reclaim_lock);
+          list_push_back (&reclaim_inodes, &inode->closed_elem);
+          reclaim_cnt++;
+          cond_signal (&reclaim_queued, &reclaim_lock);
+          lock_release (&reclaim_lock);
+        }
+      else
+        free (inode); 
+    }
+}
 
-		  for ( i = 0 ; i < LEVEL1SIZE ; i ++ )
-		  {
-			  block_sector_t *level1 = (block_sector_t *) (level1arr+(i*sizeof(block_sector_t))) ;
-			  /*printf ( "\nlevel%d: %d\n", i, *level1) ;*/
-			  if ( *level1 == 0 )
-				  continue ;
+/* Inode reclaim thread.  Frees the blocks of the removed inodes
+   queued by inode_close(), then the inodes themselves. */
+static void
+inode_reclaimer (void *aux UNUSED)
+{
+  for (;;)
+    {
+      lock_acquire (&reclaim_lock);
+      while (list_empty (&reclaim_inodes))
+        cond_wait (&reclaim_queued, &reclaim_lock);
+      struct inode *inode = list_entry (list_pop_front (&reclaim_inodes),
+                                        struct inode, closed_elem);
+      lock_release (&reclaim_lock);
+
+      inode_release_blocks (inode);
+      free_map_release (inode->sector, 1);
+      free (inode);
+
+      lock_acquire (&reclaim_lock);
+      if (--reclaim_cnt == 0)
+        cond_broadcast (&reclaim_idle, &reclaim_lock);
+      lock_release (&reclaim_lock);
+    }
+}
+
+/* Waits until the reclaim thread has freed the blocks of every
+   removed inode queued so far.  Returns true if there were any,
+   so that an allocation which failed is worth retrying.
+   Must not be called with the free map locked. */
+bool
+inode_reclaim_wait (void)
+{
+  bool waited;
 
-			  char level2arr[BLOCK_SECTOR_SIZE] ;
-			  read_cache( *level1, level2arr, 0, BLOCK_SECTOR_SIZE ) ;
+  lock_acquire (&reclaim_lock);
+  waited = reclaim_cnt > 0;
+  while (reclaim_cnt > 0)
+    cond_wait (&reclaim_idle, &reclaim_lock);
+  lock_release (&reclaim_lock);
 
-			  for ( j = 0 ; j < LEVEL2SIZE ; j ++ )
-			  {
-				  block_sector_t *level2 = (block_sector_t *) (level2arr+(j*sizeof(block_sector_t))) ;
-				  /*printf ( "level%d: %d   ", j, *level2 ) ;*/
-				  if ( *level2 == 0 )
-					  continue ;
+  return waited;
+}
 
-				  free_map_release(*level2, 1);
-			  }
+/* Writes back every open inode which changed since it was last
+   written.  Must be called with SYNC_LOCK held. */
+static void
+inode_sync_pass (void)
+{
+  struct list dirty;
+  struct hash_iterator i;
 
-			  free_map_release(*level1, 1) ;
-		  }
+  list_init (&dirty);
 
-          free_map_release (inode->sector, 1);
-          /*free_map_release (inode->data.start,*/
-                            /*bytes_to_sectors (inode->data.length)); */
+  /* Hold a reference on each dirty inode while writing it.  Open
+     inodes are not in the closed inode list, so their CLOSED_ELEM
+     is free to link them. */
+  lock_acquire (&open_lock);
+  hash_first (&i, &open_inodes);
+  while (hash_next (&i))
+    {
+      struct inode *inode = hash_entry (hash_cur (&i), struct inode, elem);
+      if (inode->open_cnt > 0 && inode->dirty)
+        {
+          inode->open_cnt++;
+          list_push_back (&dirty, &inode->closed_elem);
         }
+    }
+  lock_release (&open_lock);
+
+  while (!list_empty (&dirty))
+    inode_close (list_entry (list_pop_front (&dirty), struct inode,
+                             closed_elem));
+
+  /* Sectors released since the last pass are written here. */
+  free_map_flush ();
+}
+
+/* Writes back every open inode which changed since it was last
+   written. */
+void
+inode_sync (void)
+{
+  lock_acquire (&sync_lock);
+  if (!inode_closed)
+    inode_sync_pass ();
+  lock_release (&sync_lock);
+}
+
+/* Writes back every open inode, stops the inode flusher and
+   waits for the reclaim thread, so that neither an inode nor the
+   free map is written after the buffer cache is released. */
+void
+inode_done (void)
+{
+  lock_acquire (&sync_lock);
+  inode_sync_pass ();
+  inode_closed = true;
+  lock_release (&sync_lock);
 
-      free (inode); 
+  inode_reclaim_wait ();
+}
+
+/* Inode flusher thread.  Periodically writes back the inodes
+   whose length or extents changed. */
+static void
+inode_flusher (void *aux UNUSED)
+{
+  while (!inode_closed)
+    {
+      timer_sleep (CACHE_FLUSH_INTERVAL);
+      inode_sync ();
     }
 }
 
+/* Frees the inodes kept after their last close.
+   Returns true if any was freed. */
+bool
+inode_shrink (void)
+{
+  struct list victims;
+
+  list_init (&victims);
+
+  lock_acquire (&open_lock);
+  while (!list_empty (&closed_inodes))
+    {
+      struct list_elem *e = list_pop_front (&closed_inodes);
+      hash_delete (&open_inodes,
+                   &list_entry (e, struct inode, closed_elem)->elem);
+      list_push_back (&victims, e);
+    }
+  closed_cnt = 0;
+  lock_release (&open_lock);
+
+  if (list_empty (&victims))
+    return false;
+
+  while (!list_empty (&victims))
+    free (list_entry (list_pop_front (&victims), struct inode, closed_elem));
+  return true;
+}
+
 /* Marks INODE to be deleted when it is closed by the last caller who
    has it open. */
 void
@@ -287,11 +1138,119 @@ inode_remove (struct inode *inode)
   inode->removed = true;
 }
 
+/* Returns the data in the buffer cache of the sector holding
+   byte offset POS of INODE, pinned with access MODE, or a null
+   pointer if POS is past the end of INODE or if INODE keeps its
+   data inline.  Stores the sector number in *SECTORP.
+   The caller works on the data in place and must release the
+   sector with cache_put(). */
+void *
+inode_get_block (struct inode *inode, off_t pos, enum cache_mode mode,
+                 block_sector_t *sectorp)
+{
+  if (pos >= inode_length (inode))
+    return NULL;
+
+  /* The caller may write in place, so a hole gets its sector. */
+  block_sector_t sector_idx = byte_to_sector (inode, pos);
+  if (sector_idx == 0 && inode_fill_hole (inode, pos, pos + 1))
+    sector_idx = byte_to_sector (inode, pos);
+  if ((signed) sector_idx == -1 || sector_idx == 0)
+    return NULL;
+
+  *sectorp = sector_idx;
+  return cache_get (sector_idx, mode);
+}
+
+/* Returns a bounce buffer for a transfer of SIZE bytes which
+   bypasses the buffer cache, or a null pointer if the transfer
+   goes through the cache. */
+static uint8_t *
+inode_direct_buffer (off_t size)
+{
+  if (inode_direct_min <= 0 || size < inode_direct_min)
+    return NULL;
+  return palloc_get_multiple (0, INODE_DIRECT_PAGES);
+}
+
+/* Returns the number of sectors of INODE, at most MAX, which
+   follow one another on the disk from SECTOR, which holds byte
+   offset POS. */
+static size_t
+inode_run (struct inode *inode, off_t pos, block_sector_t sector, size_t max)
+{
+  size_t cnt = 1;
+
+  if (max > INODE_DIRECT_RUN)
+    max = INODE_DIRECT_RUN;
+  while (cnt < max
+         && byte_to_sector (inode, pos + (off_t) cnt * BLOCK_SECTOR_SIZE)
+            == sector + cnt)
+    cnt++;
+  return cnt;
+}
+
+/* Updates the read-ahead state RA of an open file for a read of
+   SIZE bytes at OFFSET, and queues the sectors past the read in
+   the read-ahead window for the read-ahead thread.
+   The window grows while reads are sequential and collapses on
+   the first random read. */
+static void
+inode_readahead (struct inode *inode, struct readahead *ra,
+                 off_t offset, off_t size)
+{
+  off_t length = inode_length (inode);
+  off_t start, target, pos;
+
+  if (offset != ra->next)
+    {
+      /* Random access. */
+      ra->window = 0;
+      ra->end = 0;
+      ra->next = offset + size;
+      return;
+    }
+
+  ra->next = offset + size;
+  if (ra->window == 0)
+    ra->window = READAHEAD_MIN;
+  else if (ra->window < READAHEAD_MAX)
+    ra->window *= 2;
+
+  /* Sectors touched by this read are fetched by the read itself. */
+  start = ROUND_UP (offset + size, BLOCK_SECTOR_SIZE);
+  target = start + ra->window * BLOCK_SECTOR_SIZE;
+  if (target > length)
+    target = length;
+
+  /* Skip what previous reads already asked for. */
+  pos = ra->end > start ? ra->end : start;
+  for (; pos < target; pos += BLOCK_SECTOR_SIZE)
+    {
+      block_sector_t sector_idx = byte_to_sector (inode, pos);
+      if ((signed) sector_idx != -1 && sector_idx != 0)
+        cache_readahead (sector_idx);
+    }
+
+  if (target > ra->end)
+    ra->end = target;
+}
+
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
    Returns the number of bytes actually read, which may be less
    than SIZE if an error occurs or end of file is reached. */
 off_t
 inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) 
+{
+  return inode_read_at_ra (inode, buffer_, size, offset, NULL);
+}
+
+/* Same as inode_read_at(), but also reads ahead asynchronously
+   according to the read-ahead state RA of an open file, if RA
+   is non-null. */
+off_t
+inode_read_at_ra (struct inode *inode, void *buffer_, off_t size,
+                  off_t offset, struct readahead *ra) 
 {
 	/*printf ( "inside inode read at\n") ;*/
   uint8_t *buffer = buffer_;
@@ -301,6 +1260,38 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
   if ( offset + size > inode_length(inode) )
 	  return 0 ;
 
+  /* Small files are copied out of the inode.  A bounce buffer
+     keeps page faults on BUFFER from happening with the inode
+     locked. */
+  if (inode_is_inline (inode))
+    {
+      uint8_t bounce[INODE_INLINE_SIZE];
+      bool done = false;
+
+      lock_acquire (&inode->lock);
+      if (inode->data.isinline)
+        {
+          memcpy (bounce, inode->data.inline_data + offset, size);
+          done = true;
+        }
+      lock_release (&inode->lock);
+
+      if (done)
+        {
+          memcpy (buffer, bounce, size);
+          return size;
+        }
+    }
+
+  /* Large reads bypass the buffer cache, so that they do not
+     push the blocks in use out of it. */
+  uint8_t *direct = inode_direct_buffer (size);
+
+  /* Queue the read-ahead before blocking on this read, so that
+     the read-ahead thread can start as soon as the disk is free. */
+  if (ra != NULL && size > 0 && direct == NULL)
+    inode_readahead (inode, ra, offset, size);
+
   while (size > 0) 
     {
       /* Disk sector to read, starting byte offset within sector. */
@@ -321,7 +1312,27 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
+      if (sector_idx == 0)
+        {
+          /* Holes read as zeros without touching the disk. */
+          memset (buffer + bytes_read, 0, chunk_size);
+        }
+      else if (direct != NULL && sector_ofs == 0
+               && chunk_size == BLOCK_SECTOR_SIZE)
+        {
+          /* Read the run of whole sectors starting here with one
+             request.  It goes through DIRECT: reading into BUFFER
+             could page fault with the disk channel held. */
+          off_t left = size < inode_left ? size : inode_left;
+          size_t cnt = inode_run (inode, offset, sector_idx,
+                                  left / BLOCK_SECTOR_SIZE);
+
+          chunk_size = cnt * BLOCK_SECTOR_SIZE;
+          cache_bypass (sector_idx, cnt, false);
+          block_read_multiple (fs_device, sector_idx, cnt, direct);
+          memcpy (buffer + bytes_read, direct, chunk_size);
+        }
+      else if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
         {
           /* Read full sector directly into caller's buffer. */
           /*block_read (fs_device, sector_idx, buffer + bytes_read);*/
@@ -348,6 +1359,8 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       bytes_read += chunk_size;
     }
   /*free (bounce);*/
+  if (direct != NULL)
+    palloc_free_multiple (direct, INODE_DIRECT_PAGES);
 
   return bytes_read;
 }
@@ -370,26 +1383,81 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
   if (inode->deny_write_cnt)
     return 0;
 
-  if ( size+offset > inode->data.length )
+  /* Writes which fit are copied into the inode of a small file.
+     Other ones move its data out to sectors first. */
+  if ( inode_is_inline ( inode ) )
+  {
+	  if ( size+offset <= (off_t) INODE_INLINE_SIZE )
+	  {
+		  uint8_t bounce[INODE_INLINE_SIZE] ;
+		  bool done = false ;
+
+		  memcpy ( bounce, buffer, size ) ;
+
+		  lock_acquire ( &inode->lock ) ;
+		  if ( inode->data.isinline )
+		  {
+			  memcpy ( inode->data.inline_data + offset, bounce, size ) ;
+			  if ( size+offset > inode->data.length )
+				  inode->data.length = size+offset ;
+			  inode->dirty = true ;
+			  done = true ;
+		  }
+		  lock_release ( &inode->lock ) ;
+
+		  if ( done )
+			  return size ;
+	  }
+	  else if ( !inode_promote ( inode ) )
+		  return 0 ;
+  }
+
+  // End of the range written. Past the end of the file, the new length is only published once the data is written
+  off_t end = size+offset ;
+
+  if ( end > inode->data.length )
   {
 	  /*printf ( "pos greater than length\n") ;*/
-	  inode->data.length = size+offset ;
+	  lock_acquire ( &inode->lock ) ;
 
-	  write_cache ( inode->sector, &inode->data, 0, BLOCK_SECTOR_SIZE, false ) ;
+	  // Allocate the new sectors first, taking the reserved ones before asking the free map.
+	  // If the disk fills up, the file only grows as far as they go
+	  uint32_t sector_cnt = inode->data.sector_cnt ;
+	  uint32_t reserved_cnt = inode->data.reserved_cnt ;
+	  inode_claim ( inode, offset, end ) ;
+	  inode_grow ( inode, end, offset, end ) ;
+	  if ( inode->data.sector_cnt != sector_cnt || inode->data.reserved_cnt != reserved_cnt )
+		  inode->dirty = true ;
+
+	  if ( end > (off_t) inode->data.sector_cnt * BLOCK_SECTOR_SIZE )
+		  end = (off_t) inode->data.sector_cnt * BLOCK_SECTOR_SIZE ;
+
+	  lock_release ( &inode->lock ) ;
   }
 
+  // Large writes bypass the buffer cache, like large reads
+  uint8_t *direct = inode_direct_buffer ( size ) ;
+
   while (size > 0) 
     {
       /* Sector to write, starting byte offset within sector. */
       block_sector_t sector_idx = byte_to_sector (inode, offset);
+
+	  // Writing into a hole allocates sectors for the part of it which is written
+	  if ( sector_idx == 0 )
+	  {
+		  if ( !inode_fill_hole ( inode, offset, end ) )
+			  break ;
+		  sector_idx = byte_to_sector (inode, offset);
+	  }
 	  if ( (signed)sector_idx == -1 )
 		  break ;
 
 	  /*printf ( "  finished byte to sector\n");*/
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
-      /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = inode_length (inode) - offset;
+      /* Bytes left in range, bytes left in sector, lesser of the two. */
+      off_t inode_left = end - offset;
       int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
       int min_left = inode_left < sector_left ? inode_left : sector_left;
 
@@ -399,7 +1467,19 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
+      if ( direct != NULL && sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE )
+        {
+		  // Write the run of whole sectors starting here with one request, through DIRECT like reads
+		  off_t left = size < inode_left ? size : inode_left ;
+		  size_t cnt = inode_run ( inode, offset, sector_idx, left / BLOCK_SECTOR_SIZE ) ;
+
+		  chunk_size = cnt * BLOCK_SECTOR_SIZE ;
+		  memcpy ( direct, buffer + bytes_written, chunk_size ) ;
+		  cache_bypass ( sector_idx, cnt, true ) ;
+		  block_write_multiple ( fs_device, sector_idx, cnt, direct ) ;
+		  cache_bypass ( sector_idx, cnt, true ) ;
+        }
+      else if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
         {
           /* Write full sector directly to disk. */
           /*block_write (fs_device, sector_idx, buffer + bytes_written);*/
@@ -437,6 +1517,20 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       bytes_written += chunk_size;
     }
   /*free (bounce);*/
+  if ( direct != NULL )
+	  palloc_free_multiple ( direct, INODE_DIRECT_PAGES ) ;
+
+  // The new length stays in memory. It is written back on close, by inode_sync() or by the inode flusher
+  if ( offset > inode->data.length )
+  {
+	  lock_acquire ( &inode->lock ) ;
+	  if ( offset > inode->data.length )
+	  {
+		  inode->data.length = offset ;
+		  inode->dirty = true ;
+	  }
+	  lock_release ( &inode->lock ) ;
+  }
 
   /*printf ( "Bytes written: %d\n", bytes_written) ;*/
   return bytes_written;
@@ -462,6 +1556,97 @@ inode_allow_write (struct inode *inode)
   inode->deny_write_cnt--;
 }
 
+/* Reserves sectors for INODE to grow to LENGTH bytes, in as few
+   runs as the free map allows, so that the writes which append to
+   it later neither allocate nor scatter its data.  The reserved
+   sectors are not zeroed.  The length of INODE does not change.
+   Returns false if the disk is full or LENGTH is too large, in
+   which case the sectors reserved so far are given back. */
+bool
+inode_reserve (struct inode *inode, off_t length)
+{
+  struct inode_disk *d = &inode->data;
+  bool success = true;
+
+  if (length <= inode_length (inode))
+    return true;
+  if (inode_is_inline (inode) && length > (off_t) INODE_INLINE_SIZE
+      && !inode_promote (inode))
+    return false;
+
+  lock_acquire (&inode->lock);
+  if (!d->isinline)
+    {
+      uint32_t sector_cnt = d->sector_cnt;
+
+      success = inode_grow (inode, length,
+                            (off_t) sector_cnt * BLOCK_SECTOR_SIZE, length);
+      if (!success)
+        extent_truncate (inode, sector_cnt);
+      d->reserved_cnt += d->sector_cnt - sector_cnt;
+
+      /* A failed reservation may still have linked spill blocks. */
+      if (d->sector_cnt != sector_cnt || !success)
+        inode->dirty = true;
+    }
+  lock_release (&inode->lock);
+
+  return success;
+}
+
+/* Returns the sector of the hash index of directory INODE, or 0
+   if it has none. */
+block_sector_t
+inode_get_index (const struct inode *inode)
+{
+  return inode->data.dir_index;
+}
+
+/* Returns the number of buckets of the hash index of directory
+   INODE. */
+uint32_t
+inode_index_buckets (const struct inode *inode)
+{
+  return inode->data.dir_index_buckets;
+}
+
+/* Returns the hash index of directory INODE, opened, or a null
+   pointer if it has none.  The caller must close it.  INODE keeps
+   the index open until its own last opener closes it, so that
+   only the first call reads the inode of the index. */
+struct inode *
+inode_open_index (struct inode *inode)
+{
+  struct inode *index;
+
+  lock_acquire (&inode->lock);
+  if (inode->dir_index == NULL && inode->data.dir_index != 0)
+    inode->dir_index = inode_open (inode->data.dir_index);
+  index = inode_reopen (inode->dir_index);
+  lock_release (&inode->lock);
+
+  return index;
+}
+
+/* Records SECTOR, with BUCKET_CNT buckets, as the hash index of
+   directory INODE. */
+void
+inode_set_index (struct inode *inode, block_sector_t sector,
+                 uint32_t bucket_cnt)
+{
+  struct inode *old;
+
+  lock_acquire (&inode->lock);
+  old = inode->dir_index;
+  inode->dir_index = NULL;
+  inode->data.dir_index = sector;
+  inode->data.dir_index_buckets = bucket_cnt;
+  inode->dirty = true;
+  lock_release (&inode->lock);
+
+  inode_close (old);
+}
+
 /* Returns the length, in bytes, of INODE's data. */
 off_t
 inode_length (const struct inode *inode)
@@ -470,6 +1655,13 @@ inode_length (const struct inode *inode)
   return inode->data.length;
 }
 
+/* Returns true if INODE keeps its data inline. */
+bool
+inode_is_inline (const struct inode *inode)
+{
+  return inode->data.isinline != 0;
+}
+
 // Returns true if the inode represents a directory
 bool inode_isdir ( const struct inode *inode )
 {
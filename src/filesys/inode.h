@@ -5,28 +5,98 @@
 #include "filesys/off_t.h"
 #include "devices/block.h"
 #include <list.h>
+#include <hash.h>
+#include "filesys/cache.h"
+#include "threads/synch.h"
 
 struct bitmap;
 
+/* Run of consecutive sectors of a file on the disk. */
+struct inode_extent
+  {
+    block_sector_t start;               /* First sector, or 0 for a hole. */
+    uint32_t length;                    /* Number of sectors. */
+  };
+
+/* Largest size of a file in bytes. */
+#define MAXFILESIZE (1 << 23)
+
+/* Number of extents held by the inode itself.  The next ones
+   spill into a chain of extent blocks. */
+#define INODE_EXTENTS 59
+
+/* Most bytes of data a file may keep inline in its inode, in the
+   space of the extents. */
+#define INODE_INLINE_SIZE (INODE_EXTENTS * sizeof (struct inode_extent))
+
 /* On-disk inode.
    Must be exactly BLOCK_SECTOR_SIZE bytes long. */
 struct inode_disk
   {
-    block_sector_t start;               /* First data sector. */
     off_t length;                       /* File size in bytes. */
     unsigned magic;                     /* Magic number. */
 	int isdir ;
-    uint32_t unused[124];               /* Not used. */
+	int isinline ;						/* Data is in INLINE_DATA, not in extents. */
+    uint32_t sector_cnt;                /* Sectors mapped by extents, holes included. */
+    uint32_t extent_cnt;                /* Extents in use. */
+    block_sector_t spill;               /* First spill block, or 0. */
+    union
+      {
+        struct inode_extent extents[INODE_EXTENTS]; /* First extents, in file order. */
+        uint8_t inline_data[INODE_INLINE_SIZE];     /* Data of a small file. */
+      };
+    uint32_t reserved_cnt;              /* Last sectors of the extents reserved
+                                           ahead of the data, not zeroed. */
+    block_sector_t dir_index;           /* Hash index of a directory, or 0. */
+    uint32_t dir_index_buckets;         /* Buckets of DIR_INDEX. */
+  };
+
+/* Number of extents remembered by an open inode. */
+#define INODE_MAP_SIZE 8
+
+/* Extent remembered by an open inode, with its place in the
+   file.  An entry of length 0 is unused. */
+struct inode_map
+  {
+    uint32_t first;                     /* First sector of the file it holds. */
+    struct inode_extent extent;         /* Where those sectors are. */
+  };
+
+/* Default smallest transfer in bytes which bypasses the buffer
+   cache. */
+#define INODE_DIRECT_MIN (32 * BLOCK_SECTOR_SIZE)
+
+/* Smallest transfer which bypasses the buffer cache, or 0 to
+   never bypass it.  Can be set from the kernel command line. */
+extern int inode_direct_min;
+
+/* Most inodes kept in memory after their last close. */
+#define INODE_CLOSED_MAX 64
+
+/* Sequential read-ahead state of one open file. */
+struct readahead
+  {
+    off_t next;                         /* Offset of the next read if sequential. */
+    int window;                         /* Read-ahead window in sectors. */
+    off_t end;                          /* End of the range already requested. */
   };
 
 /* In-memory inode. */
 struct inode 
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem elem;              /* Element in the open inode table. */
+    struct list_elem closed_elem;       /* Element in the closed inode list. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
+    struct lock lock;                   /* Serializes the growth of the file. */
+    bool dirty;                         /* DATA changed since it was written. */
+    off_t disk_length;                  /* Length in the inode on the disk. */
+    struct lock map_lock;               /* Protects MAP and MAP_NEXT. */
+    struct inode_map map[INODE_MAP_SIZE]; /* Recently used extents. */
+    int map_next;                       /* Next entry of MAP to replace. */
+    struct inode *dir_index;            /* DATA.DIR_INDEX while open, or null. */
     struct inode_disk data;             /* Inode content. */
   };
 
@@ -37,13 +107,27 @@ struct inode *inode_reopen (struct inode *);
 block_sector_t inode_get_inumber (const struct inode *);
 void inode_close (struct inode *);
 void inode_remove (struct inode *);
+bool inode_shrink (void);
+void inode_sync (void);
+void inode_done (void);
+bool inode_reclaim_wait (void);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
+off_t inode_read_at_ra (struct inode *, void *, off_t size, off_t offset,
+                        struct readahead *);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
+void *inode_get_block (struct inode *, off_t pos, enum cache_mode,
+                       block_sector_t *sectorp);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
+bool inode_reserve (struct inode *, off_t length);
+block_sector_t inode_get_index (const struct inode *);
+uint32_t inode_index_buckets (const struct inode *);
+struct inode *inode_open_index (struct inode *);
+void inode_set_index (struct inode *, block_sector_t, uint32_t bucket_cnt);
 off_t inode_length (const struct inode *);
 
 bool inode_isdir ( const struct inode * ) ;
+bool inode_is_inline (const struct inode *);
 void free_zeros (void) ;
 
 #endif /* filesys/inode.h */
@@ -0,0 +1,22 @@
+#ifndef __LIB_CACHE_STATS_H
+#define __LIB_CACHE_STATS_H
+
+#include <stdint.h>
+
+/* Counters of the buffer cache, as returned by the cache_stats
+   system call.  Shared by the kernel and user programs. */
+struct cache_stats
+  {
+    int64_t lookups;            /* Sectors asked for. */
+    int64_t hits;               /* Sectors found in the cache. */
+    int64_t misses;             /* Sectors brought into the cache. */
+    int64_t clean_evictions;    /* Clean blocks evicted. */
+    int64_t dirty_evictions;    /* Dirty blocks written back and evicted. */
+    int64_t flusher_writes;     /* Dirty blocks written back by write-behind. */
+    int64_t evict_waits;        /* Lookups that waited for an evicting block. */
+    int64_t evict_wait_ticks;   /* Timer ticks spent in those waits. */
+    int32_t blocks;             /* Blocks holding a sector now. */
+    int32_t peak_blocks;        /* Most blocks ever holding a sector. */
+  };
+
+#endif /* lib/cache-stats.h */
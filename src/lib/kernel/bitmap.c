@@ -3,6 +3,7 @@
 #include <limits.h>
 #include <round.h>
 #include <stdio.h>
+#include <string.h>
 #include "threads/malloc.h"
 #ifdef FILESYS
 #include "filesys/file.h"
@@ -21,13 +22,32 @@ typedef unsigned long elem_type;
 /* Number of bits in an element. */
 #define ELEM_BITS (sizeof (elem_type) * CHAR_BIT)
 
+/* Clear bits in the range of bits covered by one node of a
+   free-run index. */
+struct bitmap_run
+  {
+    size_t pre;         /* Clear bits at the start of the range. */
+    size_t suf;         /* Clear bits at the end of the range. */
+    size_t max;         /* Longest run of clear bits in the range. */
+  };
+
 /* From the outside, a bitmap is an array of bits.  From the
    inside, it's an array of elem_type (defined above) that
-   simulates an array of bits. */
+   simulates an array of bits.
+
+   A bitmap may also have a free-run index: a complete binary
+   tree, stored as an array like a heap, whose leaves summarize
+   the clear bits of one element each and whose inner nodes
+   combine their two children.  Node 1 is the root and the leaves
+   are nodes LEAF_CNT to 2 * LEAF_CNT - 1.  Bits past the end of
+   the bitmap count as set.  With it, the first run of clear bits
+   of any length is found in logarithmic time. */
 struct bitmap
   {
     size_t bit_cnt;     /* Number of bits. */
     elem_type *bits;    /* Elements that represent bits. */
+    struct bitmap_run *index; /* Free-run index, or a null pointer. */
+    size_t leaf_cnt;    /* Leaves of INDEX, a power of 2. */
   };
 
 /* Returns the index of the element that contains the bit
@@ -68,7 +88,251 @@ last_mask (const struct bitmap *b)
   int last_bits = b->bit_cnt % ELEM_BITS;
   return last_bits ? ((elem_type) 1 << last_bits) - 1 : (elem_type) -1;
 }
+
+/* Returns an elem_type in which the bits from BIT_IDX within its
+   element up to, but not including, the bit numbered END_IDX are
+   set, both being in the same element, or END_IDX being the first
+   bit of the next one. */
+static inline elem_type
+range_mask (size_t bit_idx, size_t end_idx)
+{
+  elem_type high = end_idx - bit_idx + bit_idx % ELEM_BITS == ELEM_BITS
+                   ? (elem_type) -1
+                   : bit_mask (end_idx) - 1;
+  return high & ~(bit_mask (bit_idx) - 1);
+}
+
+/* Returns the number of bits set in W. */
+static inline size_t
+popcount (elem_type w)
+{
+  /* Adds up the bits in pairs, then in nibbles, then sums the
+     bytes with one multiplication. */
+  w = w - ((w >> 1) & 0x55555555);
+  w = (w & 0x33333333) + ((w >> 2) & 0x33333333);
+  w = (w + (w >> 4)) & 0x0f0f0f0f;
+  return (w * 0x01010101) >> 24;
+}
+
+/* Returns the index of the lowest bit set in W, which must not
+   be 0. */
+static inline size_t
+first_set (elem_type w)
+{
+  elem_type idx;
+
+  asm ("bsfl %1, %0" : "=r" (idx) : "rm" (w) : "cc");
+  return idx;
+}
+
+/* Returns the index of the highest bit set in W, which must not
+   be 0. */
+static inline size_t
+last_set (elem_type w)
+{
+  elem_type idx;
+
+  asm ("bsrl %1, %0" : "=r" (idx) : "rm" (w) : "cc");
+  return idx;
+}
+
+/* Returns element IDX of B's bits, inverted unless VALUE is
+   true, so that the bits equal to VALUE are set. */
+static inline elem_type
+elem_value (const struct bitmap *b, size_t idx, bool value)
+{
+  return value ? b->bits[idx] : ~b->bits[idx];
+}
+
+/* Returns the index of the first bit in B at or after START which
+   is set to VALUE, or the size of B if there is none. */
+static size_t
+next_bit (const struct bitmap *b, size_t start, bool value)
+{
+  size_t idx = elem_idx (start);
+  size_t last = elem_cnt (b->bit_cnt);
+  elem_type w;
+  size_t bit;
+
+  if (start >= b->bit_cnt)
+    return b->bit_cnt;
+
+  w = elem_value (b, idx, value) & ~(bit_mask (start) - 1);
+  while (w == 0)
+    {
+      if (++idx == last)
+        return b->bit_cnt;
+      w = elem_value (b, idx, value);
+    }
+
+  /* The unused bits of the last element read as set when
+     inverted. */
+  bit = idx * ELEM_BITS + first_set (w);
+  return bit < b->bit_cnt ? bit : b->bit_cnt;
+}
 
+/* Free-run index. */
+
+/* Returns element IDX of B's bits, with the bits past the end of
+   B and the ones in BELOW set. */
+static elem_type
+index_elem (const struct bitmap *b, size_t idx, elem_type below)
+{
+  size_t last = elem_cnt (b->bit_cnt);
+
+  if (idx >= last)
+    return (elem_type) -1;
+  if (idx == last - 1)
+    below |= ~last_mask (b);
+  return b->bits[idx] | below;
+}
+
+/* Returns the summary of the clear bits of W. */
+static struct bitmap_run
+elem_run (elem_type w)
+{
+  struct bitmap_run run;
+  elem_type clear = ~w;
+
+  if (w == 0)
+    {
+      run.pre = run.suf = run.max = ELEM_BITS;
+      return run;
+    }
+  run.pre = first_set (w);
+  run.suf = ELEM_BITS - 1 - last_set (w);
+
+  /* Each step shortens every run of set bits of CLEAR by one. */
+  for (run.max = 0; clear != 0; run.max++)
+    clear &= clear >> 1;
+  return run;
+}
+
+/* Sets RUN to the combination of LEFT and RIGHT, each covering
+   HALF bits. */
+static void
+combine_runs (struct bitmap_run *run, const struct bitmap_run *left,
+              const struct bitmap_run *right, size_t half)
+{
+  size_t mid = left->suf + right->pre;
+
+  run->pre = left->pre == half ? half + right->pre : left->pre;
+  run->suf = right->suf == half ? half + left->suf : right->suf;
+  run->max = left->max > right->max ? left->max : right->max;
+  if (mid > run->max)
+    run->max = mid;
+}
+
+/* Brings the index of B up to date after a change to its
+   elements FIRST through LAST, inclusive. */
+static void
+index_update (struct bitmap *b, size_t first, size_t last)
+{
+  size_t len = ELEM_BITS;
+  size_t i;
+
+  if (b->index == NULL)
+    return;
+
+  for (i = first; i <= last; i++)
+    b->index[b->leaf_cnt + i] = elem_run (index_elem (b, i, 0));
+
+  first += b->leaf_cnt;
+  last += b->leaf_cnt;
+  while (first > 1)
+    {
+      first /= 2;
+      last /= 2;
+      for (i = first; i <= last; i++)
+        combine_runs (&b->index[i], &b->index[2 * i], &b->index[2 * i + 1],
+                      len);
+      len *= 2;
+    }
+}
+
+/* Returns the number of leaves of the index of a bitmap of
+   BIT_CNT bits. */
+static size_t
+index_leaf_cnt (size_t bit_cnt)
+{
+  size_t leaf_cnt = 1;
+
+  while (leaf_cnt < elem_cnt (bit_cnt))
+    leaf_cnt *= 2;
+  return leaf_cnt;
+}
+
+/* Returns the first bit of the first run of CNT clear bits in W,
+   which must exist. */
+static size_t
+elem_find (elem_type w, size_t cnt)
+{
+  size_t i, run = 0;
+
+  for (i = 0; i < ELEM_BITS; i++)
+    if (w & ((elem_type) 1 << i))
+      run = 0;
+    else if (++run == cnt)
+      return i + 1 - cnt;
+  NOT_REACHED ();
+}
+
+/* Searches the bits at or after START of node NODE of the index
+   of B, which covers the LEN bits from LO, for the first run of
+   CNT clear bits.  *CARRY is the number of clear bits at or after
+   START right before LO, and is updated to the number right
+   before LO + LEN.  Returns the first bit of the run, or
+   BITMAP_ERROR if it does not end within the node.
+   Only the nodes on the paths to START and to the run are
+   visited, so the search takes logarithmic time. */
+static size_t
+index_find (const struct bitmap *b, size_t node, size_t lo, size_t len,
+            size_t start, size_t cnt, size_t *carry)
+{
+  struct bitmap_run run;
+  elem_type below = 0;
+
+  if (lo + len <= start)
+    return BITMAP_ERROR;
+
+  if (lo >= start)
+    run = b->index[node];
+  else if (len == ELEM_BITS)
+    {
+      /* The bits before START count as set. */
+      below = bit_mask (start) - 1;
+      run = elem_run (index_elem (b, node - b->leaf_cnt, below));
+    }
+  else
+    {
+      size_t idx = index_find (b, 2 * node, lo, len / 2, start, cnt, carry);
+      if (idx == BITMAP_ERROR)
+        idx = index_find (b, 2 * node + 1, lo + len / 2, len / 2, start, cnt,
+                          carry);
+      return idx;
+    }
+
+  if (*carry + run.pre >= cnt)
+    return lo - *carry;
+  if (run.max < cnt)
+    {
+      *carry = run.pre == len ? *carry + len : run.suf;
+      return BITMAP_ERROR;
+    }
+
+  /* The run lies within this node. */
+  if (len == ELEM_BITS)
+    return lo + elem_find (index_elem (b, node - b->leaf_cnt, below), cnt);
+  else
+    {
+      size_t idx = index_find (b, 2 * node, lo, len / 2, start, cnt, carry);
+      if (idx == BITMAP_ERROR)
+        idx = index_find (b, 2 * node + 1, lo + len / 2, len / 2, start, cnt,
+                          carry);
+      return idx;
+    }
+}
+
 /* Creation and destruction. */
 
 /* Creates and returns a pointer to a newly allocated bitmap with room for
@@ -82,6 +346,7 @@ bitmap_create (size_t bit_cnt)
   if (b != NULL)
     {
       b->bit_cnt = bit_cnt;
+      b->index = NULL;
       b->bits = malloc (byte_cnt (bit_cnt));
       if (b->bits != NULL || bit_cnt == 0)
         {
@@ -105,6 +370,7 @@ bitmap_create_in_buf (size_t bit_cnt, void *block, size_t block_size UNUSED)
 
   b->bit_cnt = bit_cnt;
   b->bits = (elem_type *) (b + 1);
+  b->index = NULL;
   bitmap_set_all (b, false);
   return b;
 }
@@ -117,6 +383,33 @@ bitmap_buf_size (size_t bit_cnt)
   return sizeof (struct bitmap) + byte_cnt (bit_cnt);
 }
 
+/* Returns the number of bytes required for the free-run index
+   of a bitmap with BIT_CNT bits (for use with
+   bitmap_index_in_buf()). */
+size_t
+bitmap_index_size (size_t bit_cnt)
+{
+  return 2 * index_leaf_cnt (bit_cnt) * sizeof (struct bitmap_run);
+}
+
+/* Gives B a free-run index in the BLOCK_SIZE bytes of storage
+   preallocated at BLOCK, built from the bits of B.  BLOCK_SIZE
+   must be at least bitmap_index_size(bitmap_size(B)).
+   Afterward, bitmap_scan() for clear bits takes logarithmic time,
+   and every change to the bits of B also updates the index: the
+   changes are no longer atomic, so the caller must serialize
+   them.  The index is never freed by bitmap_destroy(). */
+void
+bitmap_index_in_buf (struct bitmap *b, void *block, size_t block_size UNUSED)
+{
+  ASSERT (b != NULL);
+  ASSERT (block_size >= bitmap_index_size (b->bit_cnt));
+
+  b->index = block;
+  b->leaf_cnt = index_leaf_cnt (b->bit_cnt);
+  index_update (b, 0, b->leaf_cnt - 1);
+}
+
 /* Destroys bitmap B, freeing its storage.
    Not for use on bitmaps created by bitmap_create_in_buf(). */
 void
@@ -163,6 +456,7 @@ bitmap_mark (struct bitmap *b, size_t bit_idx)
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the OR instruction in [IA32-v2b]. */
   asm ("orl %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
+  index_update (b, idx, idx);
 }
 
 /* Atomically sets the bit numbered BIT_IDX in B to false. */
@@ -176,6 +470,7 @@ bitmap_reset (struct bitmap *b, size_t bit_idx)
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the AND instruction in [IA32-v2a]. */
   asm ("andl %1, %0" : "=m" (b->bits[idx]) : "r" (~mask) : "cc");
+  index_update (b, idx, idx);
 }
 
 /* Atomically toggles the bit numbered IDX in B;
@@ -191,6 +486,7 @@ bitmap_flip (struct bitmap *b, size_t bit_idx)
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the XOR instruction in [IA32-v2b]. */
   asm ("xorl %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
+  index_update (b, idx, idx);
 }
 
 /* Returns the value of the bit numbered IDX in B. */
@@ -213,18 +509,41 @@ bitmap_set_all (struct bitmap *b, bool value)
   bitmap_set_multiple (b, 0, bitmap_size (b), value);
 }
 
-/* Sets the CNT bits starting at START in B to VALUE. */
+/* Sets the CNT bits starting at START in B to VALUE.
+   Whole elements are stored at once.  The bits of the partial
+   elements at either end are set atomically. */
 void
 bitmap_set_multiple (struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
-  size_t i;
+  size_t end = start + cnt;
+  size_t first = elem_idx (start);
   
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    bitmap_set (b, start + i, value);
+  while (start < end)
+    {
+      size_t idx = elem_idx (start);
+      size_t elem_end = (idx + 1) * ELEM_BITS;
+      size_t stop = end < elem_end ? end : elem_end;
+
+      if (start % ELEM_BITS == 0 && stop == elem_end)
+        b->bits[idx] = value ? (elem_type) -1 : 0;
+      else
+        {
+          elem_type mask = range_mask (start, stop);
+
+          /* See bitmap_mark() and bitmap_reset(). */
+          if (value)
+            asm ("orl %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
+          else
+            asm ("andl %1, %0" : "=m" (b->bits[idx]) : "r" (~mask) : "cc");
+        }
+      start = stop;
+    }
+  if (cnt > 0)
+    index_update (b, first, elem_idx (end - 1));
 }
 
 /* Returns the number of bits in B between START and START + CNT,
@@ -232,17 +551,23 @@ bitmap_set_multiple (struct bitmap *b, size_t start, size_t cnt, bool value)
 size_t
 bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
-  size_t i, value_cnt;
+  size_t end = start + cnt;
+  size_t ones = 0;
 
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  value_cnt = 0;
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
-      value_cnt++;
-  return value_cnt;
+  while (start < end)
+    {
+      size_t idx = elem_idx (start);
+      size_t elem_end = (idx + 1) * ELEM_BITS;
+      size_t stop = end < elem_end ? end : elem_end;
+
+      ones += popcount (b->bits[idx] & range_mask (start, stop));
+      start = stop;
+    }
+  return value ? ones : cnt - ones;
 }
 
 /* Returns true if any bits in B between START and START + CNT,
@@ -250,15 +575,22 @@ bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
 bool
 bitmap_contains (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
-  size_t i;
+  size_t end = start + cnt;
   
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
-      return true;
+  while (start < end)
+    {
+      size_t idx = elem_idx (start);
+      size_t elem_end = (idx + 1) * ELEM_BITS;
+      size_t stop = end < elem_end ? end : elem_end;
+
+      if (elem_value (b, idx, value) & range_mask (start, stop))
+        return true;
+      start = stop;
+    }
   return false;
 }
 
@@ -291,7 +623,9 @@ bitmap_all (const struct bitmap *b, size_t start, size_t cnt)
 /* Finds and returns the starting index of the first group of CNT
    consecutive bits in B at or after START that are all set to
    VALUE.
-   If there is no such group, returns BITMAP_ERROR. */
+   If there is no such group, returns BITMAP_ERROR.
+   The search jumps from each run of bits set to VALUE to the end
+   of it, a whole element at a time. */
 size_t
 bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
@@ -301,10 +635,27 @@ bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value)
   if (cnt <= b->bit_cnt) 
     {
       size_t last = b->bit_cnt - cnt;
-      size_t i;
-      for (i = start; i <= last; i++)
-        if (!bitmap_contains (b, i, cnt, !value))
-          return i; 
+      size_t i = start;
+
+      if (cnt == 0)
+        return i <= last ? i : BITMAP_ERROR;
+      if (b->index != NULL && !value)
+        {
+          size_t carry = 0;
+          return index_find (b, 1, 0, b->leaf_cnt * ELEM_BITS, start, cnt,
+                             &carry);
+        }
+      for (;;)
+        {
+          i = next_bit (b, i, value);
+          if (i > last)
+            break;
+
+          size_t run_end = next_bit (b, i, !value);
+          if (run_end - i >= cnt)
+            return i;
+          i = run_end;
+        }
     }
   return BITMAP_ERROR;
 }
@@ -346,6 +697,7 @@ bitmap_read (struct bitmap *b, struct file *file)
       off_t size = byte_cnt (b->bit_cnt);
       success = file_read_at (file, b->bits, size, 0) == size;
       b->bits[elem_cnt (b->bit_cnt) - 1] &= last_mask (b);
+      index_update (b, 0, elem_cnt (b->bit_cnt) - 1);
     }
   return success;
 }
@@ -358,6 +710,30 @@ bitmap_write (const struct bitmap *b, struct file *file)
   off_t size = byte_cnt (b->bit_cnt);
   return file_write_at (file, b->bits, size, 0) == size;
 }
+
+/* Copies SIZE bytes of B's file image, starting at byte OFS,
+   from BUF into B.  Lets B be read a block at a time from a
+   buffer it does not own. */
+void
+bitmap_read_buf (struct bitmap *b, const void *buf, size_t ofs, size_t size)
+{
+  ASSERT (ofs + size <= byte_cnt (b->bit_cnt));
+  memcpy ((uint8_t *) b->bits + ofs, buf, size);
+  if (ofs + size == byte_cnt (b->bit_cnt) && b->bit_cnt > 0)
+    b->bits[elem_cnt (b->bit_cnt) - 1] &= last_mask (b);
+  if (size > 0)
+    index_update (b, ofs / sizeof (elem_type),
+                  (ofs + size - 1) / sizeof (elem_type));
+}
+
+/* Copies SIZE bytes of B's file image, starting at byte OFS,
+   from B into BUF. */
+void
+bitmap_write_buf (const struct bitmap *b, void *buf, size_t ofs, size_t size)
+{
+  ASSERT (ofs + size <= byte_cnt (b->bit_cnt));
+  memcpy (buf, (const uint8_t *) b->bits + ofs, size);
+}
 #endif /* FILESYS */
 
 /* Debugging. */
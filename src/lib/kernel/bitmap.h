@@ -13,6 +13,10 @@ struct bitmap *bitmap_create_in_buf (size_t bit_cnt, void *, size_t byte_cnt);
 size_t bitmap_buf_size (size_t bit_cnt);
 void bitmap_destroy (struct bitmap *);
 
+/* Free-run index. */
+size_t bitmap_index_size (size_t bit_cnt);
+void bitmap_index_in_buf (struct bitmap *, void *, size_t byte_cnt);
+
 /* Bitmap size. */
 size_t bitmap_size (const struct bitmap *);
 
@@ -43,6 +47,8 @@ struct file;
 size_t bitmap_file_size (const struct bitmap *);
 bool bitmap_read (struct bitmap *, struct file *);
 bool bitmap_write (const struct bitmap *, struct file *);
+void bitmap_read_buf (struct bitmap *, const void *, size_t ofs, size_t size);
+void bitmap_write_buf (const struct bitmap *, void *, size_t ofs, size_t size);
 #endif
 
 /* Debugging. */
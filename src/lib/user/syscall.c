@@ -182,3 +182,15 @@ inumber (int fd)
 {
   return syscall1 (SYS_INUMBER, fd);
 }
+
+bool
+cache_stats (struct cache_stats *stats) 
+{
+  return syscall1 (SYS_CACHE_STATS, stats);
+}
+
+bool
+fallocate (int fd, unsigned length) 
+{
+  return syscall2 (SYS_FALLOCATE, fd, length);
+}
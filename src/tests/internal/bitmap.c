@@ -0,0 +1,161 @@
+/* Test program and microbenchmark for lib/kernel/bitmap.c.
+
+   Checks the word-at-a-time scanning, counting and setting
+   functions against the bit-by-bit definitions on large,
+   fragmented bitmaps, and prints the time each takes.
+
+   This is not a test we will run on your submitted projects.
+   It is here for completeness.
+*/
+
+#undef NDEBUG
+#include <bitmap.h>
+#include <debug.h>
+#include <inttypes.h>
+#include <random.h>
+#include <stdio.h>
+#include "threads/test.h"
+#include "devices/timer.h"
+
+/* Number of bits in the bitmaps tested, as many as the free map
+   of a 16 MB disk. */
+#define BIT_CNT 32768
+
+/* Number of operations timed per function. */
+#define OP_CNT 2000
+
+static void fragment (struct bitmap *, size_t run_max);
+static size_t slow_count (const struct bitmap *, size_t start, size_t cnt,
+                          bool value);
+static size_t slow_scan (const struct bitmap *, size_t start, size_t cnt,
+                         bool value);
+static void verify (const struct bitmap *);
+static void benchmark (const struct bitmap *);
+
+/* Test and time the bitmap implementation. */
+void
+test (void)
+{
+  struct bitmap *b = bitmap_create (BIT_CNT);
+  size_t run_max;
+
+  ASSERT (b != NULL);
+  for (run_max = 1; run_max <= 256; run_max *= 4)
+    {
+      printf ("runs of up to %zu bits:\n", run_max);
+      fragment (b, run_max);
+      verify (b);
+      benchmark (b);
+    }
+  bitmap_destroy (b);
+  printf ("bitmap: PASS\n");
+}
+
+/* Fills B with alternating runs of set and clear bits, each
+   between 1 and RUN_MAX bits long. */
+static void
+fragment (struct bitmap *b, size_t run_max)
+{
+  size_t i = 0;
+  bool value = false;
+
+  while (i < bitmap_size (b))
+    {
+      size_t cnt = random_ulong () % run_max + 1;
+      if (cnt > bitmap_size (b) - i)
+        cnt = bitmap_size (b) - i;
+      bitmap_set_multiple (b, i, cnt, value);
+      i += cnt;
+      value = !value;
+    }
+}
+
+/* Returns the number of bits in B between START and START + CNT
+   set to VALUE, one bit at a time. */
+static size_t
+slow_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
+{
+  size_t i, value_cnt = 0;
+
+  for (i = 0; i < cnt; i++)
+    if (bitmap_test (b, start + i) == value)
+      value_cnt++;
+  return value_cnt;
+}
+
+/* Returns the first group of CNT bits of B at or after START all
+   set to VALUE, trying every start one bit at a time. */
+static size_t
+slow_scan (const struct bitmap *b, size_t start, size_t cnt, bool value)
+{
+  size_t i, j;
+
+  if (cnt > bitmap_size (b))
+    return BITMAP_ERROR;
+  for (i = start; i <= bitmap_size (b) - cnt; i++)
+    {
+      for (j = 0; j < cnt; j++)
+        if (bitmap_test (b, i + j) != value)
+          break;
+      if (j == cnt)
+        return i;
+    }
+  return BITMAP_ERROR;
+}
+
+/* Checks the results of the bitmap functions on B against the
+   bit-by-bit definitions, on random ranges. */
+static void
+verify (const struct bitmap *b)
+{
+  int i;
+
+  for (i = 0; i < 200; i++)
+    {
+      size_t start = random_ulong () % BIT_CNT;
+      size_t cnt = random_ulong () % (BIT_CNT - start + 1);
+      size_t run = random_ulong () % 64;
+      bool value = random_ulong () % 2;
+      size_t count = slow_count (b, start, cnt, value);
+
+      ASSERT (bitmap_count (b, start, cnt, value) == count);
+      ASSERT (bitmap_contains (b, start, cnt, value) == (count > 0));
+      ASSERT (bitmap_scan (b, start, run, value)
+              == slow_scan (b, start, run, value));
+    }
+}
+
+/* Prints the timer ticks taken by OP_CNT scans and counts on B,
+   bit by bit and a word at a time. */
+static void
+benchmark (const struct bitmap *b)
+{
+  int64_t start;
+  size_t cnt;
+  int i;
+
+  for (cnt = 1; cnt <= 64; cnt *= 8)
+    {
+      start = timer_ticks ();
+      for (i = 0; i < OP_CNT; i++)
+        slow_scan (b, i % 256, cnt, false);
+      printf ("  scan for %2zu clear bits: %5"PRId64" ticks bit by bit, ",
+              cnt, timer_elapsed (start));
+
+      start = timer_ticks ();
+      for (i = 0; i < OP_CNT; i++)
+        bitmap_scan (b, i % 256, cnt, false);
+      printf ("%5"PRId64" ticks by words\n", timer_elapsed (start));
+    }
+
+  start = timer_ticks ();
+  for (i = 0; i < OP_CNT / 100; i++)
+    slow_count (b, 0, BIT_CNT, true);
+  printf ("  count of the set bits: %5"PRId64" ticks bit by bit, ",
+          timer_elapsed (start));
+
+  start = timer_ticks ();
+  for (i = 0; i < OP_CNT / 100; i++)
+    bitmap_count (b, 0, BIT_CNT, true);
+  printf ("%5"PRId64" ticks by words\n", timer_elapsed (start));
+}
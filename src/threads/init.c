@@ -36,6 +36,8 @@
 #include "devices/ide.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
+#include "filesys/cache.h"
+#include "filesys/inode.h"
 #endif
 
 #ifdef VM
@@ -252,6 +254,31 @@ parse_options (char **argv)
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-cache"))
+        cache_size = atoi (value);
+      else if (!strcmp (name, "-cache-max"))
+        cache_max_size = atoi (value);
+      else if (!strcmp (name, "-dirty-age"))
+        cache_dirty_age = atoi (value);
+      else if (!strcmp (name, "-dirty-ratio"))
+        {
+          cache_dirty_ratio = value != NULL ? atoi (value) : 0;
+          if (cache_dirty_ratio <= 0 || cache_dirty_ratio > 100)
+            PANIC ("dirty ratio must be between 1 and 100 (use -h for help)");
+        }
+      else if (!strcmp (name, "-cache-policy"))
+        {
+          if (value != NULL && !strcmp (value, "clock"))
+            cache_policy = CACHE_CLOCK;
+          else if (value != NULL && !strcmp (value, "2q"))
+            cache_policy = CACHE_2Q;
+          else
+            PANIC ("unknown cache policy `%s' (use -h for help)", value);
+        }
+      else if (!strcmp (name, "-cache-lines"))
+        cache_line_sectors = CACHE_PAGE_SECTORS;
+      else if (!strcmp (name, "-direct-min"))
+        inode_direct_min = atoi (value);
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
@@ -385,6 +412,13 @@ usage (void)
           "  -f                 Format file system device during startup.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -cache=SECTORS     Keep SECTORS sectors in the buffer cache.\n"
+          "  -cache-max=SECTORS Let the buffer cache grow to SECTORS.\n"
+          "  -dirty-age=TICKS   Write back cache blocks dirty for TICKS.\n"
+          "  -dirty-ratio=PCT   Throttle writers when PCT%% of cache is dirty.\n"
+          "  -cache-policy=POL  Replace cache blocks by POL: clock or 2q.\n"
+          "  -cache-lines       Cache page-sized lines of sectors.\n"
+          "  -direct-min=BYTES  Bypass the buffer cache for BYTES or more.\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
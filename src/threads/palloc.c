@@ -7,6 +7,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include "threads/interrupt.h"
 #include "threads/loader.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
@@ -71,6 +72,7 @@ void *
 palloc_get_multiple (enum palloc_flags flags, size_t page_cnt)
 {
   struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+  enum intr_level old_level;
   void *pages;
   size_t page_idx;
 
@@ -78,7 +80,9 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt)
     return NULL;
 
   lock_acquire (&pool->lock);
+  old_level = intr_disable ();
   page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
+  intr_set_level (old_level);
   lock_release (&pool->lock);
 
   if (page_idx != BITMAP_ERROR)
@@ -117,6 +121,7 @@ palloc_get_page (enum palloc_flags flags)
 void
 palloc_free_multiple (void *pages, size_t page_cnt) 
 {
+  enum intr_level old_level;
   struct pool *pool;
   size_t page_idx;
 
@@ -137,8 +142,13 @@ palloc_free_multiple (void *pages, size_t page_cnt)
   memset (pages, 0xcc, PGSIZE * page_cnt);
 #endif
 
+  /* Pages are freed with interrupts off when a dying thread is
+     scheduled out, so the lock of the pool cannot be taken here.
+     Turning interrupts off keeps the index of free pages whole. */
+  old_level = intr_disable ();
   ASSERT (bitmap_all (pool->used_map, page_idx, page_cnt));
   bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+  intr_set_level (old_level);
 }
 
 /* Frees the page at PAGE. */
@@ -153,10 +163,13 @@ palloc_free_page (void *page)
 static void
 init_pool (struct pool *p, void *base, size_t page_cnt, const char *name) 
 {
-  /* We'll put the pool's used_map at its base.
-     Calculate the space needed for the bitmap
+  /* We'll put the pool's used_map at its base, followed by its
+     index of free runs, which finds multiple pages in logarithmic
+     time.  Calculate the space needed for the bitmap
      and subtract it from the pool's size. */
-  size_t bm_pages = DIV_ROUND_UP (bitmap_buf_size (page_cnt), PGSIZE);
+  size_t bm_size = bitmap_buf_size (page_cnt);
+  size_t index_size = bitmap_index_size (page_cnt);
+  size_t bm_pages = DIV_ROUND_UP (bm_size + index_size, PGSIZE);
   if (bm_pages > page_cnt)
     PANIC ("Not enough memory in %s for bitmap.", name);
   page_cnt -= bm_pages;
@@ -165,7 +178,8 @@ init_pool (struct pool *p, void *base, size_t page_cnt, const char *name)
 
   /* Initialize the pool. */
   lock_init (&p->lock);
-  p->used_map = bitmap_create_in_buf (page_cnt, base, bm_pages * PGSIZE);
+  p->used_map = bitmap_create_in_buf (page_cnt, base, bm_size);
+  bitmap_index_in_buf (p->used_map, (uint8_t *) base + bm_size, index_size);
   p->base = base + bm_pages * PGSIZE;
 }
 
@@ -15,6 +15,7 @@
 #include "threads/malloc.h"
 #include "devices/input.h"
 #include "filesys/inode.h"
+#include "filesys/cache.h"
 
 #ifdef VM
 #include "vm/page.h"
@@ -82,6 +83,8 @@ static bool mkdir ( const char *dir ) ;
 static bool readdir ( int fd, char *name ) ;
 static bool isdir ( int fd ) ;
 static int inumber ( int fd ) ;
+static bool cache_stats ( struct cache_stats *stats ) ;
+static bool fallocate ( int fd, unsigned length ) ;
 
 static int open_root (void) ;
 static int allocateFD (void) ;
@@ -138,7 +141,9 @@ static int argsNum[] = {
 	1,			// SYS_MKDIR
 	2,			// SYS_READDIR
 	1,			// SYS_ISDIR
-	1			// SYS_INUMBER
+	1,			// SYS_INUMBER
+	1,			// SYS_CACHE_STATS
+	2			// SYS_FALLOCATE
 } ;
 
 // Exit the OS by just calling the shutdown function
@@ -970,6 +975,38 @@ int inumber ( int fd )
 	return inumber ;
 }
 
+// Copy the counters of the buffer cache to STATS
+bool cache_stats ( struct cache_stats *stats )
+{
+	struct cache_stats kstats ;
+
+	check_buffer ( stats, sizeof *stats ) ;
+
+	cache_get_stats ( &kstats ) ;
+	memcpy ( stats, &kstats, sizeof kstats ) ;
+
+	return true ;
+}
+
+// Reserve the disk space for the file with file descriptor FD to grow to LENGTH bytes
+// Later writes which append to the file use the reserved sectors, which are contiguous when possible
+bool fallocate ( int fd, unsigned length )
+{
+	struct file_info *f = get_file_info ( fd ) ;
+	if ( f == NULL || f->file == NULL )
+		return false ;
+
+	// Larger lengths would not fit in an off_t, and no file may grow that large anyway
+	if ( length > MAXFILESIZE )
+		return false ;
+
+	lock_acquire ( &file_lock ) ;
+	bool success = file_reserve ( f->file, length ) ;
+	lock_release ( &file_lock ) ;
+
+	return success ;
+}
+
 /* Reads a word at user virtual address UADDR.
    UADDR must be below PHYS_BASE.
    Returns the word value if successful, -1 if a segfault occurred. */
@@ -1209,6 +1246,12 @@ static void syscall_handler (struct intr_frame *f)
 		case SYS_INUMBER:		f->eax = inumber ( (int)pargs[0] ) ;
 								break ;
 
+		case SYS_CACHE_STATS:	f->eax = cache_stats ( (struct cache_stats *)pargs[0] ) ;
+								break ;
+
+		case SYS_FALLOCATE:		f->eax = fallocate ( (int)pargs[0], (unsigned)pargs[1] ) ;
+								break ;
+
 		default:				break ;
 	}
 }
@@ -8,6 +8,7 @@
 #include <random.h>
 #include "userprog/pagedir.h"
 #include "vm/swap.h"
+#include "filesys/cache.h"
 
 // IMPORTANT: Functions in this file are always invoked by holding the FRAME lock
 
@@ -67,6 +68,11 @@ struct hash_elem * frame_insert ( struct hash_elem *new )
 struct frame * frame_allocate (void)
 {
 	void *kpage = palloc_get_page(PAL_USER) ;
+
+	// The buffer cache borrows free frames. Take one back before evicting a user page
+	if ( kpage == NULL && cache_shrink() )
+		kpage = palloc_get_page(PAL_USER) ;
+
 	if ( kpage == NULL )
 	{
 		// No more free frames available, evict a frame in memory